@@ -18,6 +18,46 @@ typedef struct dma_ctrl {
     uint64_t dst;
 } dma_ctrl_t;
 
+typedef struct dma_batch {
+    uint32_t count;
+    uint32_t poll_usec; // 0: return once submitted, else wait for the batch and busy-poll up to this long first
+    uint64_t entries;   // Userspace pointer to `count` dma_ctrl_t
+    uint64_t status;    // Optional userspace pointer to `count` int32_t, 0 or -errno per entry. When set,
+                        // invalid entries are skipped instead of failing the whole batch.
+} dma_batch_t;
+
+typedef struct dma_user_ctrl {
+    uint32_t op_code; // 0: user buffer -> device, 1: device -> user buffer
+    uint32_t reserved;
+    uint64_t user_addr; // Any userspace address, the pages are pinned for the transfer
+    uint64_t bytes;
+    uint64_t dev_addr; // Device memory offset
+} dma_user_ctrl_t;
+
+typedef struct dma_info {
+    uint64_t dma_buf_size; // Bytes of the DMA buffer, mmap() and the host side of dma_ctrl_t
+    uint64_t dev_mem_size; // Bytes of device memory, the device side of dma_ctrl_t
+} dma_info_t;
+
+// mmap() offsets, the DMA buffer starts at 0 and BAR1 device memory at PCIE_TEST_MMAP_DEVICE_MEM. Device memory is
+// mapped write-combined, stores reach the device in any order and need a store fence before a transfer reads them.
+#define PCIE_TEST_MMAP_DEVICE_MEM (1ull << 40)
+
+// mmap() offsets of a queue claimed with PCIE_TEST_IOCTL_CLAIM_QUEUE: its doorbell page (uncached), its descriptor
+// ring (ring_size DmaDescriptor_t) and its completion queue (ring_size DmaCplEntry_t)
+#define PCIE_TEST_MMAP_DOORBELL (2ull << 40)
+#define PCIE_TEST_MMAP_RING     (3ull << 40)
+#define PCIE_TEST_MMAP_CQ       (4ull << 40)
+
+// A queue claimed for direct submission. Its ring and completion queue start out empty with HEAD, TAIL and
+// CQ_HEAD at 0 and the first completion pass at phase 1. Descriptors carry bus addresses, the host side of a
+// transfer is dma_buf_addr plus the offset into the DMA buffer.
+typedef struct dma_queue_info {
+    uint32_t queue;
+    uint32_t ring_size;
+    uint64_t dma_buf_addr;
+} dma_queue_info_t;
+
 #define PCIE_TEST_IOCTL_PREFIX         'Z'
 #define PCIE_TEST_IOCTL_DEVICE_VERSION _IOR(PCIE_TEST_IOCTL_PREFIX, 20, uint32_t)
 #define PCIE_TEST_IOCTL_GET_STATUS     _IOR(PCIE_TEST_IOCTL_PREFIX, 21, uint32_t)
@@ -26,5 +66,9 @@ typedef struct dma_ctrl {
 #define PCIE_TEST_IOCTL_SET_INT_MASK   _IOW(PCIE_TEST_IOCTL_PREFIX, 24, uint32_t)
 #define PCIE_TEST_IOCTL_TEST_INT       _IOW(PCIE_TEST_IOCTL_PREFIX, 25, uint32_t)
 #define PCIE_TEST_IOCTL_START_TRANSFER _IOW(PCIE_TEST_IOCTL_PREFIX, 29, dma_ctrl_t)
+#define PCIE_TEST_IOCTL_SUBMIT_BATCH   _IOW(PCIE_TEST_IOCTL_PREFIX, 30, dma_batch_t)
+#define PCIE_TEST_IOCTL_USER_TRANSFER  _IOW(PCIE_TEST_IOCTL_PREFIX, 31, dma_user_ctrl_t)
+#define PCIE_TEST_IOCTL_GET_INFO       _IOR(PCIE_TEST_IOCTL_PREFIX, 32, dma_info_t)
+#define PCIE_TEST_IOCTL_CLAIM_QUEUE    _IOR(PCIE_TEST_IOCTL_PREFIX, 33, dma_queue_info_t)
 
 #endif /* PCIE_TEST_MODULE_H */
@@ -10,11 +10,17 @@
 #include <stdint.h>
 #endif // USERSPACE_APP
 
-#define PCI_TEST_DEVICE_IP_VERSION            0x0101
+// Major version in bits [15:8], it changes whenever the BAR0 programming model does
+#define PCI_TEST_DEVICE_IP_VERSION            0x0200
+#define PCI_TEST_DEVICE_IP_VERSION_MAJOR(v)   (((v) >> 8) & 0xFF)
 
-#define PCIE_TEST_DEVICE_NUM_DESC             1
-#define PCIE_TEST_DEVICE_MIMO_MAX_SIZE_BYTES  0x1000
+#define PCIE_TEST_DEVICE_NUM_DESC             256
+#define PCIE_TEST_DEVICE_NUM_VECTORS          4
+#define PCIE_TEST_DEVICE_NUM_QUEUES           4
+#define PCIE_TEST_DEVICE_QUEUE_NUM_DESC       (PCIE_TEST_DEVICE_NUM_DESC / PCIE_TEST_DEVICE_NUM_QUEUES)
+#define PCIE_TEST_DEVICE_MIMO_MAX_SIZE_BYTES  0x8000
 #define PCIE_TEST_DEVICE_MIMO_MAX_SIZE_DWORDS (PCIE_TEST_DEVICE_MIMO_MAX_SIZE_BYTES / 4)
+#define PCIE_TEST_DEVICE_BAR0_SIZE_BYTES      0x10000
 
 /* BAR0 MMIO register */
 #define PCIE_TEST_DEVICE_MMIO_CTRL_OFFSET        0x0000
@@ -26,17 +32,58 @@
 #define PCIE_TEST_DEVICE_MMIO_VER_OFFSET         0x0018
 #define PCIE_TEST_DEVICE_MMIO_LAST_ADDR          PCIE_TEST_DEVICE_MMIO_VER_OFFSET
 
+// Bit `v` of INT_MASK, INT_STATUS and INT_TRIGGER belongs to MSI-X vector `v`, queue `q` completes on vector `q`.
+// Without MSI-X all bits share the legacy interrupt line. An interrupt raised while its INT_MASK bit is clear
+// stays pending in INT_STATUS and fires once the bit is set again.
+#define PCIE_TEST_DEVICE_INT_BIT(v) (1u << (v))
+#define PCIE_TEST_DEVICE_INT_ALL    ((1u << PCIE_TEST_DEVICE_NUM_VECTORS) - 1)
+
+/* Performance counters */
+
+// Read-only 64-bit counters, cleared on reset. Reading the LOW half of a counter takes a snapshot of it and the HI
+// half returns the upper bits of that snapshot, so reading LOW then HI gives a consistent value.
+#define PCIE_TEST_DEVICE_CNT_BASE_OFFSET 0x0040
+#define PCIE_TEST_DEVICE_CNT_STRIDE      0x0008
+#define PCIE_TEST_DEVICE_CNT_OFFSET(c)   (PCIE_TEST_DEVICE_CNT_BASE_OFFSET + (c)*PCIE_TEST_DEVICE_CNT_STRIDE)
+
+#define PCIE_TEST_DEVICE_CNT_LOW 0x0000
+#define PCIE_TEST_DEVICE_CNT_HI  0x0004
+
+enum DeviceCounter_e {
+    TEST_DEVICE_CNT_BYTES_TO_DEVICE = 0x0, // Bytes moved from host to device memory
+    TEST_DEVICE_CNT_BYTES_TO_HOST = 0x1,   // Bytes moved from device to host memory
+    TEST_DEVICE_CNT_DESC_DONE = 0x2,       // Descriptors consumed, failed ones included
+    TEST_DEVICE_CNT_IRQS = 0x3,            // Interrupts signalled to the host
+    TEST_DEVICE_CNT_DMA_ERRORS = 0x4,      // Descriptors that failed
+    TEST_DEVICE_CNT_BUSY_NS = 0x5,         // Time spent running descriptors, summed over the queues
+    TEST_DEVICE_NUM_COUNTERS
+};
+
+// The CRC32C types move data like their plain counterpart and report the CRC32C (Castagnoli, initial value and
+// final xor 0xFFFFFFFF) of the moved bytes in the `result` of the completion entry. Without a completion queue
+// the result is dropped.
+// COPY, FILL and COMPARE stay within device memory, both addresses are device memory offsets. FILL and COMPARE
+// take a 64-bit pattern in place of the source address, repeated in little endian from the destination on.
+// COMPARE reports the offset of the first byte that differs from the pattern in `result`, or txSize if none
+// does, and sets mismatch in the completion status.
 enum DmaType_e {
-    TEST_DEVICE_DMA_READ = 0x0,
-    TEST_DEVICE_DMA_WRITE = 0x1,
+    TEST_DEVICE_DMA_READ = 0x0,  // Host -> device
+    TEST_DEVICE_DMA_WRITE = 0x1, // Device -> host
+    TEST_DEVICE_DMA_READ_CRC32C = 0x2,
+    TEST_DEVICE_DMA_WRITE_CRC32C = 0x3,
+    TEST_DEVICE_DMA_COPY = 0x4, // Device -> device, the ranges may overlap
+    TEST_DEVICE_DMA_FILL = 0x5,
+    TEST_DEVICE_DMA_COMPARE = 0x6,
 };
 
+#define PCIE_TEST_DEVICE_DMA_IS_TO_DEVICE(type) \
+    ((type) == TEST_DEVICE_DMA_READ || (type) == TEST_DEVICE_DMA_READ_CRC32C)
+#define PCIE_TEST_DEVICE_DMA_IS_HOST(type) ((type) <= TEST_DEVICE_DMA_WRITE_CRC32C)
+
 // Register definition for ctrl register
 typedef union __attribute__((packed)) {
     struct {
-        uint32_t start : 1;
-        uint32_t type : 2;
-        uint32_t reserved_0 : 28;
+        uint32_t reserved_0 : 31;
         uint32_t reset : 1;
     } bits;
     uint32_t all;
@@ -45,8 +92,11 @@ typedef union __attribute__((packed)) {
 // Register definition for status register
 typedef union __attribute__((packed)) {
     struct {
-        uint32_t busy_0 : 1;
-        uint32_t reserved_1 : 31;
+        uint32_t busy_0 : 1; // Queue 0 has posted descriptors
+        uint32_t busy_1 : 1;
+        uint32_t busy_2 : 1;
+        uint32_t busy_3 : 1;
+        uint32_t reserved_1 : 28;
     } bits;
     uint32_t all;
 } DeviceStatus_t;
@@ -54,7 +104,10 @@ typedef union __attribute__((packed)) {
 typedef union __attribute__((packed)) {
     struct {
         uint32_t mask_0 : 1;
-        uint32_t reserved_0 : 31;
+        uint32_t mask_1 : 1;
+        uint32_t mask_2 : 1;
+        uint32_t mask_3 : 1;
+        uint32_t reserved_0 : 28;
     } bits;
     uint32_t all;
 } DeviceIntMask_t;
@@ -62,7 +115,10 @@ typedef union __attribute__((packed)) {
 typedef union __attribute__((packed)) {
     struct {
         uint32_t int_0 : 1;
-        uint32_t reserved_0 : 31;
+        uint32_t int_1 : 1;
+        uint32_t int_2 : 1;
+        uint32_t int_3 : 1;
+        uint32_t reserved_0 : 28;
     } bits;
     uint32_t all;
 } DeviceIntStatus_t;
@@ -70,7 +126,10 @@ typedef union __attribute__((packed)) {
 typedef union __attribute__((packed)) {
     struct {
         uint32_t trigger_0 : 1;
-        uint32_t reserved_0 : 31;
+        uint32_t trigger_1 : 1;
+        uint32_t trigger_2 : 1;
+        uint32_t trigger_3 : 1;
+        uint32_t reserved_0 : 28;
     } bits;
     uint32_t all;
 } DeviceTrigger_t;
@@ -84,10 +143,97 @@ typedef union __attribute__((packed)) {
     uint32_t all;
 } DeviceVersion_t;
 
+/* Descriptor ring register */
+
+// Every queue has its own register block at PCIE_TEST_DEVICE_RING_OFFSET(q) and is processed independently.
+// The host posts descriptors at TAIL and rings the doorbell by writing the new TAIL.
+// The device consumes descriptors from HEAD until HEAD == TAIL.
+// By default the ring is the queue's share of the BAR0 descriptor array (QUEUE_NUM_DESC slots starting at
+// slot q * QUEUE_NUM_DESC). With host_mem set in RING_CTRL the device instead fetches RING_SIZE
+// descriptors (DmaDescriptor_t) from host memory at RING_BASE.
+//
+// Interrupt coalescing: the queue interrupt fires once COAL_COUNT completions are pending or COAL_USEC
+// microseconds after the first pending completion, whichever comes first. With COAL_USEC at 0 the interrupt
+// also fires when the ring is drained, which is the default of one interrupt per drained ring.
+#define PCIE_TEST_DEVICE_RING_BASE_OFFSET 0x0100
+#define PCIE_TEST_DEVICE_RING_STRIDE      0x0080
+#define PCIE_TEST_DEVICE_RING_OFFSET(q)   (PCIE_TEST_DEVICE_RING_BASE_OFFSET + (q)*PCIE_TEST_DEVICE_RING_STRIDE)
+
+#define PCIE_TEST_DEVICE_RING_HEAD        0x0000 // RO
+#define PCIE_TEST_DEVICE_RING_TAIL        0x0004
+#define PCIE_TEST_DEVICE_RING_CTRL        0x0008 // Write resets HEAD and TAIL
+#define PCIE_TEST_DEVICE_RING_SIZE        0x000C
+#define PCIE_TEST_DEVICE_RING_ADDR_LOW    0x0010
+#define PCIE_TEST_DEVICE_RING_ADDR_HI     0x0014
+#define PCIE_TEST_DEVICE_RING_COAL_COUNT  0x0018 // Completions per interrupt, 0: no limit
+#define PCIE_TEST_DEVICE_RING_COAL_USEC   0x001C // Max interrupt delay after a completion, 0: no delay
+#define PCIE_TEST_DEVICE_RING_CQ_ADDR_LOW 0x0020
+#define PCIE_TEST_DEVICE_RING_CQ_ADDR_HI  0x0024
+#define PCIE_TEST_DEVICE_RING_CQ_SIZE     0x0028 // 0: no completion queue
+#define PCIE_TEST_DEVICE_RING_CQ_HEAD     0x002C // Next entry the host will consume
+#define PCIE_TEST_DEVICE_RING_SHADOW_LOW  0x0030
+#define PCIE_TEST_DEVICE_RING_SHADOW_HI   0x0034
+#define PCIE_TEST_DEVICE_RING_KICK        0x0038 // WO, see below
+#define PCIE_TEST_DEVICE_RING_LAST_ADDR   PCIE_TEST_DEVICE_RING_KICK
+
+// Shadow tail: with RING_SHADOW set to the address of a little endian uint32_t in host memory, the host can ring the
+// doorbell by storing the new TAIL there and writing any value to RING_KICK. The device fetches TAIL from the shadow
+// when it handles the kick, so kicks that arrive before it got to the previous one are merged. The value written to
+// RING_KICK is ignored, which lets the hypervisor turn the write into an event without decoding it. Writing TAIL
+// directly keeps working and RING_CTRL does not touch the shadow, the host resets it together with the ring. A kick
+// is ignored while RING_SHADOW points anywhere but host RAM.
+#define PCIE_TEST_DEVICE_RING_MAX_SIZE    4096
+#define PCIE_TEST_DEVICE_RING_NEXT(i, n)  (((i) + 1) % (n))
+
+// Register definition for ring ctrl register
+typedef union __attribute__((packed)) {
+    struct {
+        uint32_t host_mem : 1;
+        uint32_t reserved_0 : 31;
+    } bits;
+    uint32_t all;
+} DeviceRingCtrl_t;
+
+/* Completion queue */
+
+// With CQ_SIZE set the device writes a DmaCplEntry_t to host memory at CQ_ADDR for every consumed
+// descriptor. The phase bit of the entries written in the first pass is 1 and flips on every wrap, so the
+// host finds new entries by comparing the phase bit without reading any register. The host reports
+// consumed entries through CQ_HEAD, the device stalls the queue while the completion queue is full.
+// Writing RING_CTRL resets the completion queue as well. With MSI-X enabled, a queue with a completion
+// queue only latches its INT_STATUS bit while masked.
+typedef union __attribute__((packed)) {
+    struct {
+        uint32_t phase : 1;
+        uint32_t error : 1;    // Transfer failed, no data or partial data was moved
+        uint32_t mismatch : 1; // COMPARE found a byte that differs from the pattern
+        uint32_t reserved_0 : 29;
+    } bits;
+    uint32_t all;
+} DmaCplStatus_t;
+
+typedef struct {
+    uint32_t descId;    // Ring slot of the completed descriptor
+    uint32_t bytes;     // Bytes moved
+    uint64_t timestamp; // Completion time in ns
+    uint64_t result;    // Operation specific result, 0 for plain transfers
+    uint32_t reserved;
+    uint32_t status; // DmaCplStatus_t, written after the rest of the entry
+} DmaCplEntry_t;
+
+/* Doorbell pages */
+
+// Queue `q` also exposes RING_HEAD, RING_TAIL, RING_CQ_HEAD and RING_KICK on a page of its own at
+// PCIE_TEST_DEVICE_DOORBELL_OFFSET(q), at the same offsets as in its ring register block. The rest of the page
+// is reserved. The page can be mapped on its own, so a process drives one queue without reaching the rest of BAR0.
+#define PCIE_TEST_DEVICE_DOORBELL_BASE_OFFSET 0x8000
+#define PCIE_TEST_DEVICE_DOORBELL_STRIDE      0x1000
+#define PCIE_TEST_DEVICE_DOORBELL_OFFSET(q) \
+    (PCIE_TEST_DEVICE_DOORBELL_BASE_OFFSET + (q)*PCIE_TEST_DEVICE_DOORBELL_STRIDE)
+
 /* Descriptor register */
 
-// Toy example with 1 descriptor
-#define PCIE_TEST_DEVICE_DESC_BASE_OFFSET  0x0020
+#define PCIE_TEST_DEVICE_DESC_BASE_OFFSET  0x1000
 #define PCIE_TEST_DEVICE_DESC_OFFSET(i)    (PCIE_TEST_DEVICE_DESC_BASE_OFFSET + (i)*PCIE_TEST_DEVICE_DESC_SIZE)
 #define PCIE_TEST_DEVICE_DESC_SIZE         0x0040
 
@@ -96,21 +242,77 @@ typedef union __attribute__((packed)) {
 #define PCIE_TEST_DEVICE_DESC_DST_ADDR_HI  0x0008
 #define PCIE_TEST_DEVICE_DESC_DST_ADDR_LOW 0x000C
 #define PCIE_TEST_DEVICE_DESC_TX_SIZE      0x0010
-#define PCIE_TEST_DEVICE_DESC_LAST_ADDR    (PCIE_TEST_DEVICE_DESC_BASE_OFFSET + PCIE_TEST_DEVICE_DESC_TX_SIZE)
+#define PCIE_TEST_DEVICE_DESC_CTRL         0x0014
+#define PCIE_TEST_DEVICE_DESC_SGL_ENTRIES  0x0018
+#define PCIE_TEST_DEVICE_DESC_LAST_ADDR    PCIE_TEST_DEVICE_DESC_SGL_ENTRIES
 
+// Register definition for descriptor ctrl register
+typedef union __attribute__((packed)) {
+    struct {
+        uint32_t type : 4; // DmaType_e
+        uint32_t sgl : 1;  // Host address points to a scatter-gather list
+        uint32_t reserved_0 : 27;
+    } bits;
+    uint32_t all;
+} DmaDescCtrl_t;
+
+// Layout of a single descriptor, matches the register offsets above and the host memory ring format. Host addresses
+// must be RAM, a descriptor reaching any other address (e.g. another device's BAR) fails.
 typedef struct {
-    uint32_t ctrl;       // Nothing defined here
     uint32_t srcAddrHi;  // Source Address[63:32]
     uint32_t srcAddrLow; // Source Address[31:0]
     uint32_t dstAddrHi;  // Destination Address[63:32]
     uint32_t dstAddrLow; // Destination Address[31:0]
     uint32_t txSize;
+    uint32_t ctrl;       // DmaDescCtrl_t
+    uint32_t sglEntries; // Entries in the first scatter-gather segment
+    uint32_t reserved[9];
 } DmaDescriptor_t;
 
-#define PCIE_TEST_DEVICE_BUFF_SIZE_BYTES 0x10000
+/* Scatter-gather list */
+
+// With sgl set in the descriptor ctrl, the host address of the descriptor (src for host -> device,
+// dst for device -> host) points to a segment of sglEntries DmaSglEntry_t in host memory. The device
+// side stays contiguous and txSize is the total over all entries.
+// The last entry of a segment may be flagged chain, its address then points to the next segment
+// and len holds the number of entries in that segment.
+#define PCIE_TEST_DEVICE_SGL_MAX_ENTRIES 0x10000
+
+typedef union __attribute__((packed)) {
+    struct {
+        uint32_t chain : 1;
+        uint32_t reserved_0 : 31;
+    } bits;
+    uint32_t all;
+} DmaSglFlags_t;
+
+typedef struct {
+    uint32_t addrHi;  // Host Address[63:32]
+    uint32_t addrLow; // Host Address[31:0]
+    uint32_t len;
+    uint32_t flags; // DmaSglFlags_t
+} DmaSglEntry_t;
+
+// Default and minimum size of the BAR1 device memory, the device can be configured up to the max size
+#define PCIE_TEST_DEVICE_BUFF_SIZE_BYTES    0x10000
+#define PCIE_TEST_DEVICE_MEM_MAX_SIZE_BYTES (64ull << 30)
 
-static_assert(PCIE_TEST_DEVICE_MMIO_VER_OFFSET < PCIE_TEST_DEVICE_DESC_BASE_OFFSET,
-              "Descriptor within control register range");
+static_assert(PCIE_TEST_DEVICE_MMIO_LAST_ADDR < PCIE_TEST_DEVICE_CNT_BASE_OFFSET,
+              "Counters within control register range");
+static_assert(PCIE_TEST_DEVICE_CNT_OFFSET(TEST_DEVICE_NUM_COUNTERS) <= PCIE_TEST_DEVICE_RING_BASE_OFFSET,
+              "Ring registers within counter range");
+static_assert(PCIE_TEST_DEVICE_RING_LAST_ADDR < PCIE_TEST_DEVICE_RING_STRIDE, "Ring registers overlap next queue");
+static_assert(PCIE_TEST_DEVICE_RING_OFFSET(PCIE_TEST_DEVICE_NUM_QUEUES) <= PCIE_TEST_DEVICE_DESC_BASE_OFFSET,
+              "Descriptor within ring register range");
+static_assert(PCIE_TEST_DEVICE_MIMO_MAX_SIZE_BYTES <= PCIE_TEST_DEVICE_DOORBELL_BASE_OFFSET,
+              "Doorbell pages within register range");
+static_assert(PCIE_TEST_DEVICE_DOORBELL_OFFSET(PCIE_TEST_DEVICE_NUM_QUEUES) <= PCIE_TEST_DEVICE_BAR0_SIZE_BYTES,
+              "Doorbell pages exceed BAR0");
+static_assert(PCIE_TEST_DEVICE_NUM_QUEUES <= PCIE_TEST_DEVICE_NUM_VECTORS, "Every queue needs its own vector");
+static_assert((PCIE_TEST_DEVICE_NUM_DESC % PCIE_TEST_DEVICE_NUM_QUEUES) == 0, "Descriptors not evenly split");
+static_assert(sizeof(DmaDescriptor_t) == PCIE_TEST_DEVICE_DESC_SIZE, "Descriptor layout mismatch");
+static_assert(sizeof(DmaSglEntry_t) == 16, "Scatter-gather entry layout mismatch");
+static_assert(sizeof(DmaCplEntry_t) == 32, "Completion entry layout mismatch");
 static_assert((PCIE_TEST_DEVICE_DESC_OFFSET(PCIE_TEST_DEVICE_NUM_DESC - 1) + PCIE_TEST_DEVICE_DESC_LAST_ADDR)
                   <= PCIE_TEST_DEVICE_MIMO_MAX_SIZE_BYTES,
               "Descriptor exceeds max range");
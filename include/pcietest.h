@@ -0,0 +1,73 @@
+#ifndef PCIETEST_H
+#define PCIETEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pcie-test-module.h"
+
+// Client library for the pcie-test-module character device. A handle is used by one thread at a time, threads
+// that submit concurrently open their own handle. Calls return 0 or a negative errno unless noted otherwise.
+typedef struct pcietest pcietest_t;
+
+// Completion of an async submission
+typedef struct pcietest_cpl {
+    uint64_t token; // Token given to pcietest_submit()
+    uint64_t value; // Result of the operation on a claimed queue, e.g. the CRC32C of a checksum transfer
+    int32_t result; // 0 or a negative errno
+} pcietest_cpl_t;
+
+// `name` is a device node name such as "pcietest0" or a path. Up to `max_inflight` async submissions can be
+// outstanding, 0 disables async submission.
+pcietest_t *pcietest_open(const char *name, uint32_t max_inflight);
+void pcietest_close(pcietest_t *dev);
+int pcietest_fd(const pcietest_t *dev);
+
+/* DMA buffer, mapped once when the handle is opened */
+void *pcietest_buffer(const pcietest_t *dev);
+size_t pcietest_buffer_size(const pcietest_t *dev);
+// Bytes of device memory, the device side of a dma_ctrl_t
+uint64_t pcietest_device_size(const pcietest_t *dev);
+// BAR1 device memory mapped write-combined, offsets match the device side of a dma_ctrl_t. NULL when the driver
+// could not map it. Call pcietest_device_flush() after storing to it and before a transfer reads the stores.
+void *pcietest_device_mem(const pcietest_t *dev);
+void pcietest_device_flush(void);
+// Carve `bytes` out of the DMA buffer, `align` is a power of two. Returns NULL when no space is left.
+void *pcietest_alloc(pcietest_t *dev, size_t bytes, size_t align);
+void pcietest_free(pcietest_t *dev, void *buf);
+// Offset of `buf` inside the DMA buffer, as used for the host side of a dma_ctrl_t
+uint64_t pcietest_offset(const pcietest_t *dev, const void *buf);
+
+/* Synchronous transfers, return once the device completed them */
+// With `poll_usec` the driver busy-polls for the completion that long before sleeping on the interrupt
+int pcietest_transfer(pcietest_t *dev, const dma_ctrl_t *ctrl, uint32_t poll_usec);
+// Rings the device once for all entries. With `status` every entry gets its own result and invalid entries are
+// skipped, without it the first invalid entry fails the batch.
+int pcietest_batch(pcietest_t *dev, const dma_ctrl_t *ctrls, uint32_t count, int32_t *status, uint32_t poll_usec);
+int pcietest_user_transfer(pcietest_t *dev, const dma_user_ctrl_t *ctrl);
+
+/* Async transfers */
+// Queue `count` transfers as one batch, `ctrls` can be reused once the call returns
+int pcietest_submit(pcietest_t *dev, const dma_ctrl_t *ctrls, uint32_t count, uint64_t token);
+// Reap at least `min` and at most `max` completions, returns the number reaped
+int pcietest_reap(pcietest_t *dev, pcietest_cpl_t *cpls, uint32_t min, uint32_t max);
+// Submissions not reaped yet
+uint32_t pcietest_inflight(const pcietest_t *dev);
+
+/* Direct submission */
+// Take a device queue over for this handle. Descriptors are then written to the queue's ring and the doorbell is
+// rung from userspace, completions are reaped from its completion queue, all without a syscall. Needs
+// CAP_SYS_RAWIO, the queue goes back to the driver when the handle is closed.
+int pcietest_queue_claim(pcietest_t *dev);
+// Post `count` transfers and ring the doorbell once, -EBUSY when the ring has no room. Besides the driver op codes
+// this takes the TEST_DEVICE_DMA_*_CRC32C ones, their checksum comes back in pcietest_cpl_t.value, and
+// TEST_DEVICE_DMA_COMPARE, whose value is the offset of the first mismatch or the transfer size.
+int pcietest_queue_submit(pcietest_t *dev, const dma_ctrl_t *ctrls, uint32_t count, uint64_t token);
+// Reap up to `max` completed transfers without blocking, one completion per transfer. Returns the number reaped.
+int pcietest_queue_reap(pcietest_t *dev, pcietest_cpl_t *cpls, uint32_t max);
+
+/* Interrupts */
+// Block until the device reports an interrupt for this handle, `irq_count` receives the device interrupt count
+int pcietest_wait_interrupt(pcietest_t *dev, uint32_t *irq_count);
+
+#endif /* PCIETEST_H */
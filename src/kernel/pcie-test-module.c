@@ -2,11 +2,25 @@
 #include "pcie-test-module.h"
 
 #include <linux/atomic.h>
+#include <linux/capability.h>
 #include <linux/cdev.h>
+#include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/interrupt.h>
 #include <linux/ioctl.h>
+#include <linux/jiffies.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/poll.h>
+#include <linux/scatterlist.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uio.h>
 #include <linux/wait.h>
 
 #include <asm/io.h>
@@ -42,6 +56,65 @@ MODULE_DEVICE_TABLE(pci, pcie_id_table);
 #define PCIE_TEST_DEVICE_NUM         1
 #define PCIE_TEST_DEVICE_MINOR_COUNT 1
 
+struct pcie_device;
+struct pcie_file;
+
+// Context of one interrupt vector
+typedef struct pcie_irq {
+    struct pcie_device *pcie_device;
+    uint32_t vector;
+    uint32_t int_bits; // INT_STATUS bits handled by this vector
+} pcie_irq_t;
+
+// Submission completed once the device consumed its last descriptor, either an async write or a
+// transfer whose completion is reported to the file that submitted it
+typedef struct pcie_request {
+    struct list_head node;
+    struct kiocb *iocb;
+    struct pcie_file *file;
+    uint64_t seq;
+    ssize_t result;
+} pcie_request_t;
+
+// One device DMA queue, completes on the vector with the same index
+typedef struct pcie_queue {
+    struct pcie_device *pcie_device;
+    uint32_t id;
+    void __iomem *regs; // Ring register block of the queue
+
+    /* Descriptor ring, protected by ring_lock */
+    spinlock_t ring_lock;
+    uint32_t ring_head;
+    uint32_t ring_tail;
+    uint32_t ring_size;
+    DmaDescriptor_t *ring_virt; // NULL when the BAR0 descriptors are used
+    dma_addr_t ring_phys;
+    uint64_t ring_submitted; // Descriptors posted to the ring
+    uint64_t ring_completed; // Descriptors consumed by the device
+    wait_queue_head_t ring_wait;
+
+    /* Descriptors dropped by the last abort, see pcie_ring_abort(). Protected by ring_lock. */
+    bool ring_aborting;         // Ring reset, the device may still run a dropped descriptor
+    bool ring_dropped_in_use;   // The device did not go idle after the reset
+    uint64_t ring_dropped_from; // Sequence numbers after this one up to ring_dropped_to were dropped
+    uint64_t ring_dropped_to;
+    struct list_head ring_requests; // Outstanding pcie_request_t in submission order
+
+    /* Completion queue, protected by ring_lock. Has ring_size entries. */
+    DmaCplEntry_t *cq_virt; // NULL when completions are tracked through RING_HEAD
+    dma_addr_t cq_phys;
+    uint32_t cq_head;
+    uint32_t cq_phase; // Phase of the entries the device writes in the current pass
+
+    uint32_t poll_count; // Submitters busy-polling this queue, protected by int_mask_lock
+
+    /* Doorbell through the shadow tail, NULL when TAIL is written directly */
+    __le32 *shadow_tail;
+    void __iomem *kick; // RING_KICK on the doorbell page of the queue
+
+    struct pcie_file *owner; // File driving the queue from userspace, protected by ring_lock
+} pcie_queue_t;
+
 typedef struct pcie_device {
     char name[512];
 
@@ -52,36 +125,106 @@ typedef struct pcie_device {
 
     /* BAR0 MMIO registers */
     void __iomem *bar0_mmio;
+    spinlock_t counter_lock; // Keeps the LOW and HI read of a device counter together
+
+    /* BAR1 device memory, its size is set by the device */
+    uint64_t mem_size;
 
     /* DMA Related */
     size_t alloc_size;
     void *virt_addr;
     dma_addr_t phys_addr;
 
+    /* Shadow tails of all queues, one cache line each */
+    void *shadow_virt;
+    dma_addr_t shadow_phys;
+
+    /* DMA queues, a submission goes to the queue of the current CPU */
+    pcie_queue_t queues[PCIE_TEST_DEVICE_NUM_QUEUES];
+    uint32_t num_queues;
+    uint32_t *cpu_queue; // Queue index per CPU
+
     /* Interrupt Related */
-    uint32_t irq_count;
+    atomic_t irq_count;
+    uint32_t num_vectors;
+    pcie_irq_t irqs[PCIE_TEST_DEVICE_NUM_VECTORS];
+
+    /* INT_MASK cache, the device sees int_mask without the bits of queues being polled or claimed */
+    spinlock_t int_mask_lock;
+    uint32_t int_mask;
+    uint32_t int_polled;
+    uint32_t int_claimed; // Bit `q` set while queue `q` is claimed, read locklessly by pcie_get_queue()
+
+    /* Open files, told about interrupts that completed nothing they own */
+    spinlock_t files_lock;
+    struct list_head files;
 
     dev_t dev_number;
     int minor;
 } pcie_device_t;
 
+// Completion state of one open file, shared with its outstanding requests
+typedef struct pcie_file {
+    struct kref ref;
+    struct list_head node; // Entry in pcie_device->files
+    pcie_device_t *pcie_device;
+    atomic_t event;
+    wait_queue_head_t wait;
+    pcie_queue_t *queue; // Queue claimed for direct submission, NULL if none
+} pcie_file_t;
+
 static struct class *g_pcie_class = NULL;
 static dev_t g_base_dev;
 static DEFINE_IDA(g_device_ida);
 
-static atomic_t irq_event = ATOMIC_INIT(0);
-static DECLARE_WAIT_QUEUE_HEAD(wait_queue);
-
 static int log_level = 0;
 module_param(log_level, int, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(log_level, "Enable debug logging (0:off)");
 
+static bool host_ring = true;
+module_param(host_ring, bool, S_IRUGO);
+MODULE_PARM_DESC(host_ring, "Keep descriptors in host memory instead of BAR0 (default:on)");
+
+static bool host_cq = true;
+module_param(host_cq, bool, S_IRUGO);
+MODULE_PARM_DESC(host_cq, "Reap completions from a host memory completion queue (default:on)");
+
+static uint coalesce_count = 0;
+module_param(coalesce_count, uint, S_IRUGO);
+MODULE_PARM_DESC(coalesce_count, "Completions per queue interrupt (0:no limit)");
+
+static uint coalesce_usec = 0;
+module_param(coalesce_usec, uint, S_IRUGO);
+MODULE_PARM_DESC(coalesce_usec, "Max queue interrupt delay in us after a completion (0:signal on drained ring)");
+
+static ulong dma_buf_size = PCIE_TEST_DEVICE_BUFF_SIZE_BYTES;
+module_param(dma_buf_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(dma_buf_size, "DMA buffer size in bytes, large buffers need CMA (default:64KiB)");
+
+static bool kick_doorbell = true;
+module_param(kick_doorbell, bool, S_IRUGO);
+MODULE_PARM_DESC(kick_doorbell, "Ring the doorbell through the shadow tail and RING_KICK (default:on)");
+
+#define PCIE_TEST_DRIVER_RING_SIZE    1024
+#define PCIE_TEST_DRIVER_RING_POLL_MS 100
+#define PCIE_TEST_DRIVER_RING_TIMEOUT_MS 5000
+#define PCIE_TEST_DRIVER_POLL_MAX_USEC 10000
+#define PCIE_TEST_DRIVER_SHADOW_STRIDE 64
+static_assert(PCIE_TEST_DRIVER_RING_SIZE <= PCIE_TEST_DEVICE_RING_MAX_SIZE, "Ring exceeds device limit");
+static_assert(PCIE_TEST_DEVICE_NUM_QUEUES * PCIE_TEST_DRIVER_SHADOW_STRIDE <= PAGE_SIZE, "Shadow tails exceed a page");
+
 static int pcie_open(struct inode *inode, struct file *file);
 static int pcie_release(struct inode *inode, struct file *file);
 static long pcie_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 static int pcie_mmap(struct file *file, struct vm_area_struct *vma);
 static ssize_t pcie_read(struct file *file, char __user *buf, size_t count, loff_t *ppos);
+static ssize_t pcie_write_iter(struct kiocb *iocb, struct iov_iter *from);
 static unsigned int pcie_poll(struct file *file, poll_table *wait);
+static bool pcie_ring_reap(pcie_queue_t *queue);
+static void pcie_ring_reset(pcie_queue_t *queue);
+static void pcie_notify_files(pcie_device_t *pcie_device);
+static int pcie_queue_claim(pcie_file_t *pfile, dma_queue_info_t *info);
+static void pcie_queue_unclaim(pcie_file_t *pfile);
 
 /* Define Attributes */
 static ssize_t version_show(struct device *dev, struct device_attribute *attr, char *buf)
@@ -91,36 +234,180 @@ static ssize_t version_show(struct device *dev, struct device_attribute *attr, c
     return status;
 }
 
+// Device performance counters, reading LOW latches HI
+static ssize_t pcie_counter_show(struct device *dev, char *buf, const uint32_t counter)
+{
+    pcie_device_t *pcie_device = dev_get_drvdata(dev);
+    void __iomem *reg = pcie_device->bar0_mmio + PCIE_TEST_DEVICE_CNT_OFFSET(counter);
+    unsigned long flags;
+    uint64_t value;
+
+    spin_lock_irqsave(&pcie_device->counter_lock, flags);
+    value = readl(reg + PCIE_TEST_DEVICE_CNT_LOW);
+    value |= (uint64_t)readl(reg + PCIE_TEST_DEVICE_CNT_HI) << 32;
+    spin_unlock_irqrestore(&pcie_device->counter_lock, flags);
+
+    return sysfs_emit(buf, "%llu\n", value);
+}
+
+#define PCIE_COUNTER_ATTR(_name, _counter)                                                 \
+    static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+    {                                                                                      \
+        return pcie_counter_show(dev, buf, _counter);                                      \
+    }
+
+PCIE_COUNTER_ATTR(bytes_to_device, TEST_DEVICE_CNT_BYTES_TO_DEVICE)
+PCIE_COUNTER_ATTR(bytes_to_host, TEST_DEVICE_CNT_BYTES_TO_HOST)
+PCIE_COUNTER_ATTR(desc_done, TEST_DEVICE_CNT_DESC_DONE)
+PCIE_COUNTER_ATTR(irqs, TEST_DEVICE_CNT_IRQS)
+PCIE_COUNTER_ATTR(dma_errors, TEST_DEVICE_CNT_DMA_ERRORS)
+PCIE_COUNTER_ATTR(busy_ns, TEST_DEVICE_CNT_BUSY_NS)
+
 static struct device_attribute dev_pcie_attrs[] = {
     __ATTR_RO(version),
+    __ATTR_RO(bytes_to_device),
+    __ATTR_RO(bytes_to_host),
+    __ATTR_RO(desc_done),
+    __ATTR_RO(irqs),
+    __ATTR_RO(dma_errors),
+    __ATTR_RO(busy_ns),
     __ATTR_NULL,
 };
 
 static struct attribute *pcie_test_attrs[] = {
     &dev_pcie_attrs[0].attr,
+    &dev_pcie_attrs[1].attr,
+    &dev_pcie_attrs[2].attr,
+    &dev_pcie_attrs[3].attr,
+    &dev_pcie_attrs[4].attr,
+    &dev_pcie_attrs[5].attr,
+    &dev_pcie_attrs[6].attr,
     NULL,
 };
 
 ATTRIBUTE_GROUPS(pcie_test);
 
-// Interrupt handler function
-static irqreturn_t intHandlerHard(int irq, void *pdev)
+// Interrupt handler function, one instance per vector
+static irqreturn_t intHandlerHard(int irq, void *data)
 {
-    pcie_device_t *pcie_device = (pcie_device_t *)pdev;
+    pcie_irq_t *pcie_irq = data;
+    pcie_device_t *pcie_device = pcie_irq->pcie_device;
     struct device *dev = pcie_device->device;
 
-    dev_dbg(dev, "%s - Entered Handler\n", __func__);
-    const uint32_t value = readl(pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET);
-    if (value) {
-        pcie_device->irq_count++;
-        writel(value, pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET);
+    dev_dbg(dev, "%s - Entered Handler for vector %u\n", __func__, pcie_irq->vector);
 
-        atomic_set(&irq_event, 1);
-        wake_up_interruptible(&wait_queue);
+    // A queue with a completion queue on its own MSI-X vector does not latch INT_STATUS,
+    // its completions are reaped from host memory without reading a register
+    if (pcie_device->pdev->msix_enabled && pcie_irq->vector < pcie_device->num_queues
+        && pcie_device->queues[pcie_irq->vector].cq_virt != NULL) {
+        pcie_queue_t *queue = &pcie_device->queues[pcie_irq->vector];
+
+        atomic_inc(&pcie_device->irq_count);
+        if (!pcie_ring_reap(queue)) {
+            pcie_notify_files(pcie_device);
+        }
+        wake_up(&queue->ring_wait);
+        return IRQ_HANDLED;
+    }
+
+    const uint32_t value =
+        readl(pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET) & pcie_irq->int_bits;
+    if (value == 0) {
+        return IRQ_NONE;
+    }
+
+    atomic_inc(&pcie_device->irq_count);
+    writel(value, pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET);
+
+    // Queue `q` completes on bit `q`, wake in-kernel waiters such as pinned user transfers
+    bool isDelivered = false;
+    for (uint32_t q = 0; q < pcie_device->num_queues; q++) {
+        if (value & PCIE_TEST_DEVICE_INT_BIT(q)) {
+            isDelivered |= pcie_ring_reap(&pcie_device->queues[q]);
+            wake_up(&pcie_device->queues[q].ring_wait);
+        }
+    }
+    if (!isDelivered) {
+        pcie_notify_files(pcie_device);
     }
     return IRQ_HANDLED;
 }
 
+// Request one handler per allocated vector. Without MSI-X the single vector handles every INT_STATUS bit.
+static int pcie_irq_init(pcie_device_t *pcie_device)
+{
+    struct pci_dev *pdev = pcie_device->pdev;
+    struct device *dev = &pdev->dev;
+    struct irq_affinity affd = { 0 };
+    int err;
+
+    // Spread the vectors over the CPUs so a completion is handled close to its submitter
+    err = pci_alloc_irq_vectors_affinity(pdev, 1, PCIE_TEST_DEVICE_NUM_VECTORS, PCI_IRQ_MSIX | PCI_IRQ_AFFINITY,
+                                         &affd);
+    if (err < 0) {
+        dev_info(dev, "%s - MSI-X unavailable (%d), falling back to a single vector\n", __func__, err);
+        err = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_ALL_TYPES);
+    }
+    if (err < 0) {
+        dev_err(dev, "%s - error %d, failed to allocate irq vector\n", __func__, err);
+        return err;
+    }
+    pcie_device->num_vectors = err;
+
+    // Each queue needs its own MSI-X vector, on the legacy line all queues share one handler
+    pcie_device->num_queues = pdev->msix_enabled ? min_t(uint32_t, err, PCIE_TEST_DEVICE_NUM_QUEUES)
+                                                 : PCIE_TEST_DEVICE_NUM_QUEUES;
+
+    for (uint32_t vector = 0; vector < pcie_device->num_vectors; vector++) {
+        pcie_irq_t *pcie_irq = &pcie_device->irqs[vector];
+        pcie_irq->pcie_device = pcie_device;
+        pcie_irq->vector = vector;
+        pcie_irq->int_bits =
+            (pcie_device->num_vectors == 1) ? PCIE_TEST_DEVICE_INT_ALL : PCIE_TEST_DEVICE_INT_BIT(vector);
+
+        int irq = pci_irq_vector(pdev, vector);
+        if (log_level) {
+            dev_info(dev, "%s - Enable interrupt and register handler for vector %u to IRQ %d\n", __func__, vector,
+                     irq);
+        }
+        err = request_threaded_irq(irq, intHandlerHard, NULL, IRQF_SHARED, "PCIe test device interrupt", pcie_irq);
+        if (err) {
+            dev_err(dev, "%s - Failed to enable interrupt for vector %u\n", __func__, vector);
+            while (vector-- > 0) {
+                free_irq(pci_irq_vector(pdev, vector), &pcie_device->irqs[vector]);
+            }
+            pci_free_irq_vectors(pdev);
+            return err;
+        }
+    }
+    return 0;
+}
+
+// Stop the device from writing host memory and raising interrupts before the handlers and the memory go away
+static void pcie_quiesce(pcie_device_t *pcie_device)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&pcie_device->int_mask_lock, flags);
+    pcie_device->int_mask = 0;
+    writel(0, pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_INT_MASK_OFFSET);
+    spin_unlock_irqrestore(&pcie_device->int_mask_lock, flags);
+    pci_clear_master(pcie_device->pdev);
+}
+
+static void pcie_irq_free(pcie_device_t *pcie_device)
+{
+    struct pci_dev *pdev = pcie_device->pdev;
+
+    for (uint32_t vector = 0; vector < pcie_device->num_vectors; vector++) {
+        int irq = pci_irq_vector(pdev, vector);
+        dev_dbg(&pdev->dev, "%s - Remove interrupt handler for IRQ %d\n", __func__, irq);
+        free_irq(irq, &pcie_device->irqs[vector]);
+    }
+    pcie_device->num_vectors = 0;
+    pci_free_irq_vectors(pdev);
+}
+
 /**
  * Device file operations
  */
@@ -131,13 +418,16 @@ static const struct file_operations g_device_file_ops = {
     .mmap = pcie_mmap,
     .unlocked_ioctl = pcie_ioctl,
     .read = pcie_read,
+    .write_iter = pcie_write_iter,
     .poll = pcie_poll,
 };
 
 static unsigned int pcie_poll(struct file *file, poll_table *wait)
 {
-    poll_wait(file, &wait_queue, wait);
-    if (atomic_read(&irq_event)) {
+    pcie_file_t *pfile = file->private_data;
+
+    poll_wait(file, &pfile->wait, wait);
+    if (atomic_read(&pfile->event)) {
         return POLLIN | POLLRDNORM;
     }
     return 0;
@@ -145,13 +435,16 @@ static unsigned int pcie_poll(struct file *file, poll_table *wait)
 
 static ssize_t pcie_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {
-    pcie_device_t *pcie_device = file->private_data;
+    pcie_file_t *pfile = file->private_data;
+    pcie_device_t *pcie_device = pfile->pcie_device;
     struct device *dev = &pcie_device->pdev->dev;
 
-    wait_event_interruptible(wait_queue, atomic_read(&irq_event) != 0);
-    atomic_set(&irq_event, 0);
+    if (wait_event_interruptible(pfile->wait, atomic_read(&pfile->event) != 0) != 0) {
+        return -ERESTARTSYS;
+    }
+    atomic_set(&pfile->event, 0);
 
-    uint32_t irq_count = pcie_device->irq_count;
+    uint32_t irq_count = atomic_read(&pcie_device->irq_count);
     if (count < sizeof(irq_count)) {
         return -EINVAL;
     }
@@ -166,18 +459,735 @@ static ssize_t pcie_read(struct file *file, char __user *buf, size_t count, loff
     return sizeof(irq_count);
 }
 
+static void pcie_file_free(struct kref *ref)
+{
+    kfree(container_of(ref, pcie_file_t, ref));
+}
+
+// Wake the waiters of one file, safe from the interrupt handler
+static void pcie_file_notify(pcie_file_t *pfile)
+{
+    atomic_set(&pfile->event, 1);
+    wake_up_interruptible(&pfile->wait);
+}
+
+static void pcie_notify_files(pcie_device_t *pcie_device)
+{
+    pcie_file_t *pfile;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pcie_device->files_lock, flags);
+    list_for_each_entry(pfile, &pcie_device->files, node) {
+        pcie_file_notify(pfile);
+    }
+    spin_unlock_irqrestore(&pcie_device->files_lock, flags);
+}
+
 static int pcie_open(struct inode *inode, struct file *file)
 {
     pcie_device_t *pcie_device = container_of(inode->i_cdev, pcie_device_t, cdev);
-    file->private_data = pcie_device;
+    unsigned long flags;
+
+    pcie_file_t *pfile = kzalloc(sizeof(pcie_file_t), GFP_KERNEL);
+    if (pfile == NULL) {
+        return -ENOMEM;
+    }
+    kref_init(&pfile->ref);
+    pfile->pcie_device = pcie_device;
+    atomic_set(&pfile->event, 0);
+    init_waitqueue_head(&pfile->wait);
+
+    spin_lock_irqsave(&pcie_device->files_lock, flags);
+    list_add_tail(&pfile->node, &pcie_device->files);
+    spin_unlock_irqrestore(&pcie_device->files_lock, flags);
+
+    file->private_data = pfile;
+
+    // Async writes never block, io_uring can issue them inline
+    file->f_mode |= FMODE_NOWAIT;
+    return 0;
+}
+
+static int pcie_release(struct inode *inode, struct file *file)
+{
+    pcie_file_t *pfile = file->private_data;
+    pcie_device_t *pcie_device = pfile->pcie_device;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pcie_device->files_lock, flags);
+    list_del(&pfile->node);
+    spin_unlock_irqrestore(&pcie_device->files_lock, flags);
+
+    // Every mapping of the queue is gone by now, they hold the file
+    pcie_queue_unclaim(pfile);
+
+    // Transfers still in flight keep the state alive until they complete
+    kref_put(&pfile->ref, pcie_file_free);
+    return 0;
+}
+
+static bool pcie_mem_in_range(pcie_device_t *pcie_device, const uint64_t addr, const uint32_t bytes)
+{
+    return addr <= pcie_device->mem_size && bytes <= pcie_device->mem_size - addr;
+}
+
+static int pcie_check_transfer(pcie_device_t *pcie_device, const dma_ctrl_t *ctrl)
+{
+    struct device *dev = pcie_device->device;
+
+    // Stays within device memory, a fill carries its pattern in src
+    if (ctrl->op_code == TEST_DEVICE_DMA_COPY || ctrl->op_code == TEST_DEVICE_DMA_FILL) {
+        if (!pcie_mem_in_range(pcie_device, ctrl->dst, ctrl->bytes)
+            || (ctrl->op_code == TEST_DEVICE_DMA_COPY && !pcie_mem_in_range(pcie_device, ctrl->src, ctrl->bytes))) {
+            dev_err_ratelimited(dev, "%s - Device operation out of range (%u bytes @ 0x%llx)!\n", __func__,
+                                ctrl->bytes, ctrl->dst);
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    if (pcie_device->virt_addr == NULL) {
+        dev_err(dev, "%s - Invalid dma buf address!\n", __func__);
+        return -EFAULT;
+    }
+
+    if (ctrl->op_code > TEST_DEVICE_DMA_WRITE) {
+        dev_err(dev, "%s - Invalid op code (%u)!\n", __func__, ctrl->op_code);
+        return -EFAULT;
+    }
+
+    // Host offsets are relative to the DMA buffer, device offsets to device memory
+    const uint64_t host_addr = (ctrl->op_code == TEST_DEVICE_DMA_READ) ? ctrl->src : ctrl->dst;
+    const uint64_t dev_addr = (ctrl->op_code == TEST_DEVICE_DMA_READ) ? ctrl->dst : ctrl->src;
+    if (host_addr > pcie_device->alloc_size || ctrl->bytes > pcie_device->alloc_size - host_addr
+        || !pcie_mem_in_range(pcie_device, dev_addr, ctrl->bytes)) {
+        dev_err_ratelimited(dev, "%s - Transfer out of range (%u bytes @ 0x%llx to 0x%llx)!\n", __func__,
+                            ctrl->bytes, ctrl->src, ctrl->dst);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+// Build the descriptor of a transfer, host offsets are translated to the DMA buffer bus address
+static void pcie_build_desc(pcie_device_t *pcie_device, const dma_ctrl_t *ctrl, DmaDescriptor_t *desc)
+{
+    uint64_t final_dst_addr = ctrl->dst;
+    uint64_t final_src_addr = ctrl->src;
+    if (ctrl->op_code == TEST_DEVICE_DMA_READ) {
+        final_src_addr = ctrl->src + pcie_device->phys_addr;
+    } else if (ctrl->op_code == TEST_DEVICE_DMA_WRITE) {
+        final_dst_addr = ctrl->dst + pcie_device->phys_addr;
+    }
+
+    DmaDescCtrl_t descCtrl = { 0 };
+    descCtrl.bits.type = ctrl->op_code;
+
+    memset(desc, 0, sizeof(*desc));
+    desc->srcAddrHi = upper_32_bits(final_src_addr);
+    desc->srcAddrLow = lower_32_bits(final_src_addr);
+    desc->dstAddrHi = upper_32_bits(final_dst_addr);
+    desc->dstAddrLow = lower_32_bits(final_dst_addr);
+    desc->txSize = ctrl->bytes;
+    desc->ctrl = descCtrl.all;
+}
+
+// Write a descriptor into ring slot `idx` of a queue
+static void pcie_write_desc(pcie_queue_t *queue, const uint32_t idx, const DmaDescriptor_t *desc)
+{
+    pcie_device_t *pcie_device = queue->pcie_device;
+    DmaDescCtrl_t descCtrl = { .all = desc->ctrl };
+
+    if (log_level) {
+        dev_info(pcie_device->device, "%s - Queue %u slot %u. Type %u, Src 0x%x%08x, dst 0x%x%08x, size %u\n",
+                 __func__, queue->id, idx, descCtrl.bits.type, desc->srcAddrHi, desc->srcAddrLow, desc->dstAddrHi,
+                 desc->dstAddrLow, desc->txSize);
+    }
+
+    if (queue->ring_virt != NULL) {
+        // Ordered before the doorbell by the writel() barrier
+        DmaDescriptor_t *slot = &queue->ring_virt[idx];
+        slot->srcAddrHi = cpu_to_le32(desc->srcAddrHi);
+        slot->srcAddrLow = cpu_to_le32(desc->srcAddrLow);
+        slot->dstAddrHi = cpu_to_le32(desc->dstAddrHi);
+        slot->dstAddrLow = cpu_to_le32(desc->dstAddrLow);
+        slot->txSize = cpu_to_le32(desc->txSize);
+        slot->ctrl = cpu_to_le32(desc->ctrl);
+        slot->sglEntries = cpu_to_le32(desc->sglEntries);
+        return;
+    }
+
+    // The queue owns QUEUE_NUM_DESC consecutive BAR0 descriptors
+    const uint32_t bar_idx = (queue->id * PCIE_TEST_DEVICE_QUEUE_NUM_DESC) + idx;
+    void __iomem *slot = pcie_device->bar0_mmio + PCIE_TEST_DEVICE_DESC_OFFSET(bar_idx);
+    writel(desc->srcAddrHi, slot + PCIE_TEST_DEVICE_DESC_SRC_ADDR_HI);
+    writel(desc->srcAddrLow, slot + PCIE_TEST_DEVICE_DESC_SRC_ADDR_LOW);
+    writel(desc->dstAddrHi, slot + PCIE_TEST_DEVICE_DESC_DST_ADDR_HI);
+    writel(desc->dstAddrLow, slot + PCIE_TEST_DEVICE_DESC_DST_ADDR_LOW);
+    writel(desc->txSize, slot + PCIE_TEST_DEVICE_DESC_TX_SIZE);
+    writel(desc->ctrl, slot + PCIE_TEST_DEVICE_DESC_CTRL);
+    if (descCtrl.bits.sgl) {
+        writel(desc->sglEntries, slot + PCIE_TEST_DEVICE_DESC_SGL_ENTRIES);
+    }
+}
+
+// Consume the completion entries the device wrote since the last call. Called with ring_lock held.
+static void pcie_cq_reap(pcie_queue_t *queue)
+{
+    uint32_t count = 0;
+
+    for (;;) {
+        DmaCplEntry_t *entry = &queue->cq_virt[queue->cq_head];
+        DmaCplStatus_t status = { .all = le32_to_cpu(READ_ONCE(entry->status)) };
+        if (status.bits.phase != queue->cq_phase) {
+            break;
+        }
+
+        // Only read the rest of the entry after the phase says it is complete
+        dma_rmb();
+        if (status.bits.error) {
+            dev_err_ratelimited(queue->pcie_device->device, "%s - Queue %u descriptor %u failed\n", __func__,
+                                queue->id, le32_to_cpu(entry->descId));
+        }
+        queue->ring_head = PCIE_TEST_DEVICE_RING_NEXT(le32_to_cpu(entry->descId), queue->ring_size);
+        queue->ring_completed++;
+
+        queue->cq_head = PCIE_TEST_DEVICE_RING_NEXT(queue->cq_head, queue->ring_size);
+        if (queue->cq_head == 0) {
+            queue->cq_phase ^= 1;
+        }
+        count++;
+    }
+
+    // Hand the entries back, a posted write
+    if (count != 0) {
+        writel(queue->cq_head, queue->regs + PCIE_TEST_DEVICE_RING_CQ_HEAD);
+    }
+}
+
+// Account descriptors the device consumed since the last call. Called with ring_lock held.
+static void pcie_ring_update_head(pcie_queue_t *queue)
+{
+    if (queue->cq_virt != NULL) {
+        pcie_cq_reap(queue);
+        return;
+    }
+
+    const uint32_t head = readl(queue->regs + PCIE_TEST_DEVICE_RING_HEAD);
+
+    queue->ring_completed += (head - queue->ring_head + queue->ring_size) % queue->ring_size;
+    queue->ring_head = head;
+}
+
+static void pcie_request_complete(struct list_head *requests, const ssize_t err)
+{
+    pcie_request_t *req, *next;
+
+    list_for_each_entry_safe(req, next, requests, node) {
+        list_del(&req->node);
+        if (req->iocb != NULL) {
+            req->iocb->ki_complete(req->iocb, (err != 0) ? err : req->result);
+        } else {
+            pcie_file_notify(req->file);
+            kref_put(&req->file->ref, pcie_file_free);
+        }
+        kfree(req);
+    }
+}
+
+// Returns whether a request was completed
+static bool pcie_ring_reap(pcie_queue_t *queue)
+{
+    pcie_request_t *req, *next;
+    unsigned long flags;
+    LIST_HEAD(done);
+
+    spin_lock_irqsave(&queue->ring_lock, flags);
+    // A claimed queue's completion queue belongs to userspace
+    if (queue->owner != NULL) {
+        spin_unlock_irqrestore(&queue->ring_lock, flags);
+        return false;
+    }
+    pcie_ring_update_head(queue);
+    list_for_each_entry_safe(req, next, &queue->ring_requests, node) {
+        if (req->seq > queue->ring_completed) {
+            break;
+        }
+        list_move_tail(&req->node, &done);
+    }
+    spin_unlock_irqrestore(&queue->ring_lock, flags);
+
+    // Complete outside the lock, the callback may queue work of its own
+    const bool isDelivered = !list_empty(&done);
+    pcie_request_complete(&done, 0);
+    return isDelivered;
+}
+
+// Request reporting its completion to `pfile`
+static pcie_request_t *pcie_file_request(pcie_file_t *pfile)
+{
+    pcie_request_t *req = kzalloc(sizeof(pcie_request_t), GFP_KERNEL);
+    if (req != NULL) {
+        kref_get(&pfile->ref);
+        req->file = pfile;
+    }
+    return req;
+}
+
+// Drop a request that was never submitted
+static void pcie_request_free(pcie_request_t *req)
+{
+    if (req != NULL && req->file != NULL) {
+        kref_put(&req->file->ref, pcie_file_free);
+    }
+    kfree(req);
+}
+
+static bool pcie_ring_is_done(pcie_queue_t *queue, const uint64_t seq)
+{
+    unsigned long flags;
+    bool isDone;
+
+    spin_lock_irqsave(&queue->ring_lock, flags);
+    // Dropped descriptors are only done once the device stopped running them
+    isDone = (!queue->ring_aborting && queue->ring_completed >= seq);
+    spin_unlock_irqrestore(&queue->ring_lock, flags);
+    return isDone;
+}
+
+// Give up on every descriptor outstanding on the queue unless `seq` completed meanwhile. The ring is reset and the
+// device gets PCIE_TEST_DRIVER_RING_TIMEOUT_MS to finish the descriptor it may be running, the waiters of the
+// dropped descriptors are released after that.
+static void pcie_ring_abort(pcie_queue_t *queue, const uint64_t seq)
+{
+    pcie_device_t *pcie_device = queue->pcie_device;
+    unsigned long flags;
+    LIST_HEAD(aborted);
+
+    spin_lock_irqsave(&queue->ring_lock, flags);
+    // Another waiter is already resetting the queue, its wait for the device is bounded
+    while (queue->ring_aborting) {
+        spin_unlock_irqrestore(&queue->ring_lock, flags);
+        wait_event(queue->ring_wait, !READ_ONCE(queue->ring_aborting));
+        spin_lock_irqsave(&queue->ring_lock, flags);
+    }
+    pcie_ring_update_head(queue);
+    if (queue->ring_completed >= seq) {
+        spin_unlock_irqrestore(&queue->ring_lock, flags);
+        return;
+    }
+
+    const uint64_t dropped = queue->ring_submitted - queue->ring_completed;
+    queue->ring_dropped_from = queue->ring_completed;
+    queue->ring_dropped_to = queue->ring_submitted;
+    queue->ring_aborting = true;
+    list_splice_init(&queue->ring_requests, &aborted);
+    pcie_ring_reset(queue);
+    spin_unlock_irqrestore(&queue->ring_lock, flags);
+
+    dev_warn(pcie_device->device, "%s - Queue %u stalled, dropped %llu descriptors\n", __func__, queue->id, dropped);
+    pcie_request_complete(&aborted, -EIO);
+
+    // The reset stops the device at the end of the descriptor it is running, STATUS has a busy bit per queue
+    const unsigned long deadline = jiffies + msecs_to_jiffies(PCIE_TEST_DRIVER_RING_TIMEOUT_MS);
+    bool isIdle = false;
+    while (!time_after(jiffies, deadline)) {
+        if (!(readl(pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_STATUS_OFFSET) & BIT(queue->id))) {
+            isIdle = true;
+            break;
+        }
+        usleep_range(10, 100);
+    }
+    if (!isIdle) {
+        dev_err(pcie_device->device, "%s - Queue %u did not go idle after the reset\n", __func__, queue->id);
+    }
+
+    spin_lock_irqsave(&queue->ring_lock, flags);
+    queue->ring_dropped_in_use = !isIdle;
+    queue->ring_aborting = false;
+    spin_unlock_irqrestore(&queue->ring_lock, flags);
+    wake_up_all(&queue->ring_wait);
+}
+
+// Block until the descriptor with sequence number `seq` was consumed by the device. When that takes longer than
+// PCIE_TEST_DRIVER_RING_TIMEOUT_MS or the task is killed, the queue is aborted. Returns 0 once the descriptor
+// completed, otherwise -ETIMEDOUT, -EINTR or -EIO when another waiter dropped it. `isInUse`, if given, tells
+// whether the device may still access the buffers of a dropped descriptor.
+static int pcie_ring_wait(pcie_queue_t *queue, const uint64_t seq, bool *isInUse)
+{
+    const unsigned long deadline = jiffies + msecs_to_jiffies(PCIE_TEST_DRIVER_RING_TIMEOUT_MS);
+    unsigned long flags;
+    int err = 0;
+
+    while (!pcie_ring_is_done(queue, seq)) {
+        // Check the head ourselves in case the interrupt is masked
+        const long remaining = wait_event_killable_timeout(queue->ring_wait, pcie_ring_is_done(queue, seq),
+                                                           msecs_to_jiffies(PCIE_TEST_DRIVER_RING_POLL_MS));
+        if (remaining < 0) {
+            err = -EINTR;
+            break;
+        }
+        if (remaining == 0) {
+            pcie_ring_reap(queue);
+            if (time_after(jiffies, deadline)) {
+                err = -ETIMEDOUT;
+                break;
+            }
+        }
+    }
+    if (err != 0) {
+        pcie_ring_abort(queue, seq);
+    }
+
+    spin_lock_irqsave(&queue->ring_lock, flags);
+    const bool isDropped = (seq > queue->ring_dropped_from && seq <= queue->ring_dropped_to);
+    if (isInUse != NULL) {
+        *isInUse = isDropped && queue->ring_dropped_in_use;
+    }
+    spin_unlock_irqrestore(&queue->ring_lock, flags);
+
+    if (!isDropped) {
+        return 0;
+    }
+    return (err != 0) ? err : -EIO;
+}
+
+// Caller holds int_mask_lock
+static void pcie_int_mask_update(pcie_device_t *pcie_device)
+{
+    writel(pcie_device->int_mask & ~(pcie_device->int_polled | pcie_device->int_claimed),
+           pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_INT_MASK_OFFSET);
+}
+
+// Keep the queue interrupt masked while at least one submitter busy-polls it. The device holds back what
+// completes in the meantime and fires it on unmask, so sleeping waiters on the same queue are not lost.
+static void pcie_queue_poll_begin(pcie_queue_t *queue)
+{
+    pcie_device_t *pcie_device = queue->pcie_device;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pcie_device->int_mask_lock, flags);
+    if (queue->poll_count++ == 0) {
+        pcie_device->int_polled |= PCIE_TEST_DEVICE_INT_BIT(queue->id);
+        pcie_int_mask_update(pcie_device);
+    }
+    spin_unlock_irqrestore(&pcie_device->int_mask_lock, flags);
+}
+
+static void pcie_queue_poll_end(pcie_queue_t *queue)
+{
+    pcie_device_t *pcie_device = queue->pcie_device;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pcie_device->int_mask_lock, flags);
+    if (--queue->poll_count == 0) {
+        pcie_device->int_polled &= ~PCIE_TEST_DEVICE_INT_BIT(queue->id);
+        pcie_int_mask_update(pcie_device);
+    }
+    spin_unlock_irqrestore(&pcie_device->int_mask_lock, flags);
+}
+
+// Wait for sequence number `seq`, spinning on the completion state for up to `poll_usec` with the queue
+// interrupt masked before sleeping on the interrupt
+static int pcie_ring_poll(pcie_queue_t *queue, const uint64_t seq, const uint32_t poll_usec)
+{
+    const ktime_t deadline = ktime_add_us(ktime_get(), min_t(uint32_t, poll_usec, PCIE_TEST_DRIVER_POLL_MAX_USEC));
+
+    while (!need_resched() && ktime_before(ktime_get(), deadline)) {
+        pcie_ring_reap(queue);
+        if (pcie_ring_is_done(queue, seq)) {
+            break;
+        }
+        cpu_relax();
+    }
+    pcie_queue_poll_end(queue);
+
+    return pcie_ring_wait(queue, seq, NULL);
+}
+
+// Queue serving the current CPU. Migrating afterwards is harmless, every queue takes its own lock.
+// CPUs of a claimed queue share the first unclaimed one, queue 0 is never claimed.
+static pcie_queue_t *pcie_get_queue(pcie_device_t *pcie_device)
+{
+    const unsigned long claimed = READ_ONCE(pcie_device->int_claimed);
+    uint32_t q = pcie_device->cpu_queue[raw_smp_processor_id()];
+
+    if (claimed & PCIE_TEST_DEVICE_INT_BIT(q)) {
+        q = ffz(claimed);
+    }
+    return &pcie_device->queues[q];
+}
+
+// Post `count` descriptors to the ring and ring the doorbell once.
+// On success `seq` holds the sequence number that completes the last descriptor, `req` is completed by the
+// reap that sees it.
+static int pcie_submit(pcie_queue_t *queue, const DmaDescriptor_t *descs, const uint32_t count, uint64_t *seq,
+                       pcie_request_t *req)
+{
+    unsigned long flags;
+    uint32_t used, free_slots;
+
+    spin_lock_irqsave(&queue->ring_lock, flags);
+
+    // Claimed after the caller picked it
+    if (queue->owner != NULL) {
+        spin_unlock_irqrestore(&queue->ring_lock, flags);
+        return -EAGAIN;
+    }
+
+    used = (queue->ring_tail - queue->ring_head + queue->ring_size) % queue->ring_size;
+    free_slots = queue->ring_size - 1 - used;
+    if (count > free_slots) {
+        // Only go to the device for the head when the cached value says the ring is full
+        pcie_ring_update_head(queue);
+        used = (queue->ring_tail - queue->ring_head + queue->ring_size) % queue->ring_size;
+        free_slots = queue->ring_size - 1 - used;
+    }
+
+    if (count > free_slots) {
+        spin_unlock_irqrestore(&queue->ring_lock, flags);
+        return -EBUSY;
+    }
+
+    for (uint32_t idx = 0; idx < count; idx++) {
+        pcie_write_desc(queue, queue->ring_tail, &descs[idx]);
+        queue->ring_tail = PCIE_TEST_DEVICE_RING_NEXT(queue->ring_tail, queue->ring_size);
+    }
+    if (queue->shadow_tail != NULL) {
+        // The device reads the shadow when it handles the kick, writel() orders the store before it
+        WRITE_ONCE(*queue->shadow_tail, cpu_to_le32(queue->ring_tail));
+        writel(1, queue->kick);
+    } else {
+        writel(queue->ring_tail, queue->regs + PCIE_TEST_DEVICE_RING_TAIL);
+    }
+
+    queue->ring_submitted += count;
+    if (seq != NULL) {
+        *seq = queue->ring_submitted;
+    }
+    // Queued under the same lock as the doorbell so no reap can miss it
+    if (req != NULL) {
+        req->seq = queue->ring_submitted;
+        list_add_tail(&req->node, &queue->ring_requests);
+    }
+
+    spin_unlock_irqrestore(&queue->ring_lock, flags);
     return 0;
 }
 
-static int pcie_release(struct inode *inode, struct file *file) { return 0; }
+// DMA directly between a pinned user buffer and device memory, returns once the transfer completed
+static long pcie_user_transfer(pcie_device_t *pcie_device, const dma_user_ctrl_t *ctrl)
+{
+    struct device *dev = &pcie_device->pdev->dev;
+    pcie_queue_t *queue = pcie_get_queue(pcie_device);
+    const bool isToDevice = (ctrl->op_code == TEST_DEVICE_DMA_READ);
+    const enum dma_data_direction dir = isToDevice ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+    const unsigned long offset = ctrl->user_addr & ~PAGE_MASK;
+    DmaSglEntry_t *sgl;
+    dma_addr_t sgl_phys;
+    struct page **pages;
+    struct sg_table sgt;
+    struct scatterlist *sg;
+    unsigned long nr_pages;
+    long pinned;
+    uint64_t seq;
+    uint32_t idx;
+    int err;
+
+    if (ctrl->op_code > TEST_DEVICE_DMA_WRITE || ctrl->bytes == 0 || ctrl->bytes > U32_MAX
+        || ctrl->dev_addr > pcie_device->mem_size || ctrl->bytes > (pcie_device->mem_size - ctrl->dev_addr)) {
+        dev_err(dev, "%s - Invalid transfer!\n", __func__);
+        return -EINVAL;
+    }
+
+    nr_pages = DIV_ROUND_UP(offset + ctrl->bytes, PAGE_SIZE);
+    if (nr_pages > PCIE_TEST_DEVICE_SGL_MAX_ENTRIES) {
+        return -EINVAL;
+    }
+
+    pages = kvmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+    if (pages == NULL) {
+        return -ENOMEM;
+    }
+
+    // The device writes into the pages for device -> host
+    pinned = pin_user_pages_fast(ctrl->user_addr & PAGE_MASK, nr_pages, isToDevice ? 0 : FOLL_WRITE, pages);
+    if (pinned < 0) {
+        err = pinned;
+        goto pin_user_pages_fail;
+    }
+    if (pinned != nr_pages) {
+        err = -EFAULT;
+        goto sg_alloc_table_fail;
+    }
+
+    err = sg_alloc_table_from_pages(&sgt, pages, nr_pages, offset, ctrl->bytes, GFP_KERNEL);
+    if (err) {
+        goto sg_alloc_table_fail;
+    }
+
+    err = dma_map_sgtable(dev, &sgt, dir, 0);
+    if (err) {
+        goto dma_map_fail;
+    }
+
+    // One SGL entry per mapped segment, the device walks it from a single descriptor
+    sgl = dma_alloc_coherent(dev, sgt.nents * sizeof(DmaSglEntry_t), &sgl_phys, GFP_KERNEL);
+    if (sgl == NULL) {
+        err = -ENOMEM;
+        goto sgl_alloc_fail;
+    }
+
+    for_each_sgtable_dma_sg(&sgt, sg, idx)
+    {
+        sgl[idx].addrHi = cpu_to_le32(upper_32_bits(sg_dma_address(sg)));
+        sgl[idx].addrLow = cpu_to_le32(lower_32_bits(sg_dma_address(sg)));
+        sgl[idx].len = cpu_to_le32(sg_dma_len(sg));
+        sgl[idx].flags = 0;
+    }
+
+    DmaDescCtrl_t descCtrl = { 0 };
+    descCtrl.bits.type = ctrl->op_code;
+    descCtrl.bits.sgl = 1;
+
+    DmaDescriptor_t desc = { 0 };
+    const uint64_t src_addr = isToDevice ? sgl_phys : ctrl->dev_addr;
+    const uint64_t dst_addr = isToDevice ? ctrl->dev_addr : sgl_phys;
+    desc.srcAddrHi = upper_32_bits(src_addr);
+    desc.srcAddrLow = lower_32_bits(src_addr);
+    desc.dstAddrHi = upper_32_bits(dst_addr);
+    desc.dstAddrLow = lower_32_bits(dst_addr);
+    desc.txSize = ctrl->bytes;
+    desc.ctrl = descCtrl.all;
+    desc.sglEntries = sgt.nents;
+
+    err = pcie_submit(queue, &desc, 1, &seq, NULL);
+    if (err == 0) {
+        // Pages stay pinned until the device is done with them
+        bool isInUse = false;
+        err = pcie_ring_wait(queue, seq, &isInUse);
+        if (isInUse) {
+            // Leak the pages and the SGL rather than hand them back while the device may still write them
+            dev_err(dev, "%s - Device still owns the transfer, leaking %d pinned pages\n", __func__, pinned);
+            return err;
+        }
+    }
+
+    dma_free_coherent(dev, sgt.nents * sizeof(DmaSglEntry_t), sgl, sgl_phys);
+
+sgl_alloc_fail:
+    dma_unmap_sgtable(dev, &sgt, dir, 0);
+
+dma_map_fail:
+    sg_free_table(&sgt);
+
+sg_alloc_table_fail:
+    unpin_user_pages_dirty_lock(pages, pinned, !isToDevice);
+
+pin_user_pages_fail:
+    kvfree(pages);
+    return err;
+}
+
+// Check all entries in one pass and build the descriptors of the valid ones. Without `status` the first
+// invalid entry fails the batch, with it every entry gets its own result and the invalid ones are skipped.
+// Returns the number of descriptors built.
+static int pcie_build_batch(pcie_device_t *pcie_device, const dma_ctrl_t *entries, const uint32_t count,
+                            DmaDescriptor_t *descs, int32_t *status)
+{
+    uint32_t built = 0;
+
+    for (uint32_t idx = 0; idx < count; idx++) {
+        const int err = pcie_check_transfer(pcie_device, &entries[idx]);
+        if (status != NULL) {
+            status[idx] = err;
+        }
+        if (err != 0) {
+            if (status == NULL) {
+                return err;
+            }
+            continue;
+        }
+        pcie_build_desc(pcie_device, &entries[idx], &descs[built++]);
+    }
+    return built;
+}
+
+// Every write is a batch of dma_ctrl_t on the queue of the current CPU. A synchronous write returns once
+// the batch completed. An async kiocb (aio, io_uring) returns after the doorbell and completes with the
+// written size once the device consumed the batch, so one thread can keep many batches in flight.
+static ssize_t pcie_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    pcie_file_t *pfile = iocb->ki_filp->private_data;
+    pcie_device_t *pcie_device = pfile->pcie_device;
+    pcie_queue_t *queue = pcie_get_queue(pcie_device);
+    const size_t bytes = iov_iter_count(from);
+    const uint32_t count = bytes / sizeof(dma_ctrl_t);
+    const gfp_t gfp = (iocb->ki_flags & IOCB_NOWAIT) ? GFP_NOWAIT : GFP_KERNEL;
+    pcie_request_t *req = NULL;
+    uint64_t seq = 0;
+    ssize_t result;
+
+    if (bytes % sizeof(dma_ctrl_t) != 0 || count == 0 || count >= queue->ring_size) {
+        return -EINVAL;
+    }
+    // A plain write returns only once the device completed the batch, which RWF_NOWAIT does not allow
+    if (is_sync_kiocb(iocb) && (iocb->ki_flags & IOCB_NOWAIT)) {
+        return -EAGAIN;
+    }
+
+    dma_ctrl_t *entries = kmalloc_array(count, sizeof(dma_ctrl_t), gfp);
+    DmaDescriptor_t *descs = kmalloc_array(count, sizeof(DmaDescriptor_t), gfp);
+    if (!is_sync_kiocb(iocb)) {
+        req = kzalloc(sizeof(pcie_request_t), gfp);
+    }
+    if (entries == NULL || descs == NULL || (!is_sync_kiocb(iocb) && req == NULL)) {
+        result = -ENOMEM;
+        goto out;
+    }
+
+    if (copy_from_iter(entries, bytes, from) != bytes) {
+        result = -EFAULT;
+        goto out;
+    }
+
+    result = pcie_build_batch(pcie_device, entries, count, descs, NULL);
+    if (result < 0) {
+        goto out;
+    }
+
+    if (req != NULL) {
+        req->iocb = iocb;
+        req->result = bytes;
+    }
+    result = pcie_submit(queue, descs, count, &seq, req);
+    if (result == -EBUSY) {
+        result = -EAGAIN;
+    }
+    if (result != 0) {
+        goto out;
+    }
+
+    if (req != NULL) {
+        req = NULL;
+        result = -EIOCBQUEUED;
+    } else {
+        result = pcie_ring_wait(queue, seq, NULL);
+        if (result == 0) {
+            result = bytes;
+        }
+    }
+
+out:
+    kfree(req);
+    kfree(entries);
+    kfree(descs);
+    return result;
+}
 
 static long pcie_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-    pcie_device_t *pcie_device = file->private_data;
+    pcie_file_t *pfile = file->private_data;
+    pcie_device_t *pcie_device = pfile->pcie_device;
     struct device *dev = pcie_device->device;
 
     long result = -EFAULT;
@@ -190,6 +1200,14 @@ static long pcie_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
             result = 0;
         }
     } break;
+    case PCIE_TEST_IOCTL_GET_INFO: {
+        const dma_info_t value = { .dma_buf_size = pcie_device->alloc_size, .dev_mem_size = pcie_device->mem_size };
+        if (copy_to_user((dma_info_t *)arg, &value, sizeof(value))) {
+            result = -EFAULT;
+        } else {
+            result = 0;
+        }
+    } break;
     case PCIE_TEST_IOCTL_GET_STATUS: {
         const uint32_t value = readl(pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_STATUS_OFFSET);
         if (copy_to_user((uint32_t *)arg, &value, sizeof(value))) {
@@ -220,7 +1238,12 @@ static long pcie_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
         if (copy_from_user(&value, (uint32_t *)arg, sizeof(value)) != 0) {
             result = -EFAULT;
         } else {
-            writel(value, pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_INT_MASK_OFFSET);
+            unsigned long flags;
+
+            spin_lock_irqsave(&pcie_device->int_mask_lock, flags);
+            pcie_device->int_mask = value;
+            pcie_int_mask_update(pcie_device);
+            spin_unlock_irqrestore(&pcie_device->int_mask_lock, flags);
             result = 0;
         }
     } break;
@@ -234,53 +1257,114 @@ static long pcie_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
         }
     } break;
     case PCIE_TEST_IOCTL_START_TRANSFER: {
-        result = 0;
         dma_ctrl_t value = { 0 };
-        if (copy_from_user(&value, (uint32_t *)arg, sizeof(dma_ctrl_t)) != 0) {
+        if (copy_from_user(&value, (dma_ctrl_t *)arg, sizeof(dma_ctrl_t)) != 0) {
             dev_err(dev, "%s - Failed to parse instruction!\n", __func__);
-            result = -EFAULT;
+            return -EFAULT;
         }
 
-        if (pcie_device->virt_addr == NULL) {
-            dev_err(dev, "%s - Invalid dma buf address!\n", __func__);
-            result = -EFAULT;
+        result = pcie_check_transfer(pcie_device, &value);
+        if (result == 0) {
+            DmaDescriptor_t desc;
+            pcie_build_desc(pcie_device, &value, &desc);
+
+            // The completion wakes this file only
+            pcie_request_t *req = pcie_file_request(pfile);
+            if (req == NULL) {
+                return -ENOMEM;
+            }
+            result = pcie_submit(pcie_get_queue(pcie_device), &desc, 1, NULL, req);
+            if (result != 0) {
+                pcie_request_free(req);
+            }
+        }
+    } break;
+    case PCIE_TEST_IOCTL_SUBMIT_BATCH: {
+        dma_batch_t batch = { 0 };
+        if (copy_from_user(&batch, (dma_batch_t *)arg, sizeof(dma_batch_t)) != 0) {
+            dev_err(dev, "%s - Failed to parse batch!\n", __func__);
+            return -EFAULT;
+        }
+
+        // A batch stays on one queue so its descriptors run in order
+        pcie_queue_t *queue = pcie_get_queue(pcie_device);
+        if (batch.count == 0 || batch.count >= queue->ring_size) {
+            dev_err(dev, "%s - Invalid batch size (%u)!\n", __func__, batch.count);
+            return -EINVAL;
         }
 
-        if (value.op_code > 1) {
-            dev_err(dev, "%s - Invalid op code (%u)!\n", __func__, value.op_code);
+        dma_ctrl_t *entries = kmalloc_array(batch.count, sizeof(dma_ctrl_t), GFP_KERNEL);
+        DmaDescriptor_t *descs = kmalloc_array(batch.count, sizeof(DmaDescriptor_t), GFP_KERNEL);
+        int32_t *status = (batch.status != 0) ? kmalloc_array(batch.count, sizeof(int32_t), GFP_KERNEL) : NULL;
+        if (entries == NULL || descs == NULL || (batch.status != 0 && status == NULL)) {
+            kfree(entries);
+            kfree(descs);
+            kfree(status);
+            return -ENOMEM;
+        }
+
+        result = 0;
+        if (copy_from_user(entries, u64_to_user_ptr(batch.entries), batch.count * sizeof(dma_ctrl_t)) != 0) {
+            dev_err(dev, "%s - Failed to parse batch entries!\n", __func__);
             result = -EFAULT;
         }
 
+        // The valid entries go out with a single doorbell
+        uint32_t built = 0;
+        bool isChecked = false;
         if (result == 0) {
-            uint32_t descOffset = PCIE_TEST_DEVICE_DESC_OFFSET(0);
-
-            if (log_level) {
-                dev_info(dev, "%s - Performing transfer. Op Code %u, Src 0x%llx, dst 0x%llx, size %u\n", __func__,
-                         value.op_code, value.src, value.dst, value.bytes);
+            result = pcie_build_batch(pcie_device, entries, batch.count, descs, status);
+            isChecked = true;
+            if (result == 0) {
+                result = -EINVAL;
+            } else if (result > 0) {
+                built = result;
+                result = 0;
             }
+        }
+
+        if (result == 0 && batch.poll_usec != 0) {
+            uint64_t seq = 0;
 
-            uint64_t final_dst_addr = value.dst;
-            uint64_t final_src_addr = value.src;
-            if (value.op_code == 0) {
-                final_src_addr = value.src + pcie_device->phys_addr;
+            // Mask before the doorbell so the completion cannot interrupt the spin
+            pcie_queue_poll_begin(queue);
+            result = pcie_submit(queue, descs, built, &seq, NULL);
+            if (result == 0) {
+                result = pcie_ring_poll(queue, seq, batch.poll_usec);
             } else {
-                final_dst_addr = value.dst + pcie_device->phys_addr;
+                pcie_queue_poll_end(queue);
             }
-            writel(((uint64_t)final_src_addr >> 32) & U32_MAX,
-                   pcie_device->bar0_mmio + descOffset + PCIE_TEST_DEVICE_DESC_SRC_ADDR_HI);
-            writel(((uint64_t)final_src_addr) & U32_MAX,
-                   pcie_device->bar0_mmio + descOffset + PCIE_TEST_DEVICE_DESC_SRC_ADDR_LOW);
-            writel(((uint64_t)final_dst_addr >> 32) & U32_MAX,
-                   pcie_device->bar0_mmio + descOffset + PCIE_TEST_DEVICE_DESC_DST_ADDR_HI);
-            writel(((uint64_t)final_dst_addr) & U32_MAX,
-                   pcie_device->bar0_mmio + descOffset + PCIE_TEST_DEVICE_DESC_DST_ADDR_LOW);
-            writel(value.bytes, pcie_device->bar0_mmio + descOffset + PCIE_TEST_DEVICE_DESC_TX_SIZE);
-
-            DeviceCtrl_t ctrl = { 0 };
-            ctrl.bits.start = 1;
-            ctrl.bits.type = value.op_code;
-            writel(ctrl.all, pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_CTRL_OFFSET);
-            result = 0;
+        } else if (result == 0) {
+            pcie_request_t *req = pcie_file_request(pfile);
+            result = (req != NULL) ? pcie_submit(queue, descs, built, NULL, req) : -ENOMEM;
+            if (result != 0) {
+                pcie_request_free(req);
+            }
+        }
+
+        // Also reported when no entry was valid
+        if (status != NULL && isChecked && (result == 0 || built == 0)
+            && copy_to_user(u64_to_user_ptr(batch.status), status, batch.count * sizeof(int32_t)) != 0) {
+            result = -EFAULT;
+        }
+        kfree(entries);
+        kfree(descs);
+        kfree(status);
+    } break;
+    case PCIE_TEST_IOCTL_USER_TRANSFER: {
+        dma_user_ctrl_t value = { 0 };
+        if (copy_from_user(&value, (dma_user_ctrl_t *)arg, sizeof(dma_user_ctrl_t)) != 0) {
+            dev_err(dev, "%s - Failed to parse instruction!\n", __func__);
+            return -EFAULT;
+        }
+
+        result = pcie_user_transfer(pcie_device, &value);
+    } break;
+    case PCIE_TEST_IOCTL_CLAIM_QUEUE: {
+        dma_queue_info_t value = { 0 };
+        result = pcie_queue_claim(pfile, &value);
+        if (result == 0 && copy_to_user((dma_queue_info_t *)arg, &value, sizeof(value)) != 0) {
+            result = -EFAULT;
         }
     } break;
     default:
@@ -289,20 +1373,305 @@ static long pcie_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
     return result;
 }
 
+// Map the doorbell page, descriptor ring or completion queue of the queue claimed by `pfile`, each as a whole
+static int pcie_mmap_queue(pcie_file_t *pfile, struct vm_area_struct *vma, const uint64_t offset)
+{
+    pcie_device_t *pcie_device = pfile->pcie_device;
+    pcie_queue_t *queue = pfile->queue;
+    struct device *dev = &pcie_device->pdev->dev;
+
+    if (queue == NULL) {
+        return -EINVAL;
+    }
+
+    vma->vm_pgoff = 0;
+    switch (offset) {
+    case PCIE_TEST_MMAP_DOORBELL: {
+        const resource_size_t bar0 = pci_resource_start(pcie_device->pdev, 0);
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+        return vm_iomap_memory(vma, bar0 + PCIE_TEST_DEVICE_DOORBELL_OFFSET(queue->id), PAGE_SIZE);
+    }
+    case PCIE_TEST_MMAP_RING:
+        return dma_mmap_coherent(dev, vma, queue->ring_virt, queue->ring_phys,
+                                 queue->ring_size * sizeof(DmaDescriptor_t));
+    case PCIE_TEST_MMAP_CQ:
+        return dma_mmap_coherent(dev, vma, queue->cq_virt, queue->cq_phys, queue->ring_size * sizeof(DmaCplEntry_t));
+    default:
+        return -EINVAL;
+    }
+}
+
 static int pcie_mmap(struct file *file, struct vm_area_struct *vma)
 {
-    pcie_device_t *pcie_device = file->private_data;
+    pcie_file_t *pfile = file->private_data;
+    pcie_device_t *pcie_device = pfile->pcie_device;
     struct device *dev = pcie_device->device;
 
     unsigned long size = vma->vm_end - vma->vm_start;
-    unsigned long pfn = virt_to_phys(pcie_device->virt_addr) >> PAGE_SHIFT;
+    const uint64_t offset = (uint64_t)vma->vm_pgoff << PAGE_SHIFT;
+
+    if (offset >= PCIE_TEST_MMAP_DOORBELL) {
+        return pcie_mmap_queue(pfile, vma, offset);
+    }
 
+    if (offset >= PCIE_TEST_MMAP_DEVICE_MEM) {
+        dev_dbg(dev, "%s - mapping device memory to userspace (size: %lu)\n", __func__, size);
+
+        // BAR1 is prefetchable RAM, write-combining lets streaming stores go out as full bursts
+        vma->vm_pgoff -= PCIE_TEST_MMAP_DEVICE_MEM >> PAGE_SHIFT;
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+        return vm_iomap_memory(vma, pci_resource_start(pcie_device->pdev, 1), pcie_device->mem_size);
+    }
+
+    if (pcie_device->virt_addr == NULL)
+        return -ENOMEM;
     if (size > pcie_device->alloc_size)
         return -EINVAL;
 
-    dev_dbg(dev, "%s - mapping DMA buffer to userspace (size: %lu, pfn: 0x%lx)\n", __func__, size, pfn);
+    dev_dbg(dev, "%s - mapping DMA buffer to userspace (size: %lu)\n", __func__, size);
 
-    return remap_pfn_range(vma, vma->vm_start, pfn, size, vma->vm_page_prot);
+    // Works for whatever backs the buffer, including CMA pages outside the linear map
+    return dma_mmap_coherent(&pcie_device->pdev->dev, vma, pcie_device->virt_addr, pcie_device->phys_addr,
+                             pcie_device->alloc_size);
+}
+
+// Start the ring and the completion queue over, the device must not be processing the queue
+static void pcie_ring_reset(pcie_queue_t *queue)
+{
+    DeviceRingCtrl_t ringCtrl = { 0 };
+
+    ringCtrl.bits.host_mem = (queue->ring_virt != NULL);
+    if (queue->cq_virt != NULL) {
+        memset(queue->cq_virt, 0, queue->ring_size * sizeof(DmaCplEntry_t));
+    }
+    queue->cq_head = 0;
+    queue->cq_phase = 1;
+    if (queue->shadow_tail != NULL) {
+        WRITE_ONCE(*queue->shadow_tail, 0);
+    }
+
+    // Resets the device head and tail and the completion queue
+    writel(ringCtrl.all, queue->regs + PCIE_TEST_DEVICE_RING_CTRL);
+    queue->ring_head = 0;
+    queue->ring_tail = 0;
+    // Sequence numbers keep counting, whatever was outstanding is gone
+    queue->ring_completed = queue->ring_submitted;
+}
+
+// Allocate the host memory descriptor ring of a queue, falls back to its BAR0 descriptors on failure
+static void pcie_ring_init(pcie_queue_t *queue)
+{
+    pcie_device_t *pcie_device = queue->pcie_device;
+    struct device *dev = &pcie_device->pdev->dev;
+
+    queue->ring_size = PCIE_TEST_DEVICE_QUEUE_NUM_DESC;
+    queue->ring_virt = NULL;
+    if (host_ring) {
+        queue->ring_virt = dma_alloc_coherent(dev, PCIE_TEST_DRIVER_RING_SIZE * sizeof(DmaDescriptor_t),
+                                              &queue->ring_phys, GFP_KERNEL);
+        if (queue->ring_virt == NULL) {
+            dev_warn(dev, "%s - Failed to allocate host ring %u, using BAR0 descriptors\n", __func__, queue->id);
+        }
+    }
+
+    if (queue->ring_virt != NULL) {
+        queue->ring_size = PCIE_TEST_DRIVER_RING_SIZE;
+        writel(lower_32_bits(queue->ring_phys), queue->regs + PCIE_TEST_DEVICE_RING_ADDR_LOW);
+        writel(upper_32_bits(queue->ring_phys), queue->regs + PCIE_TEST_DEVICE_RING_ADDR_HI);
+        writel(queue->ring_size, queue->regs + PCIE_TEST_DEVICE_RING_SIZE);
+    }
+
+    // Completion queue with one entry per ring slot, the device can never run out of entries
+    queue->cq_virt = NULL;
+    if (host_cq) {
+        queue->cq_virt =
+            dma_alloc_coherent(dev, queue->ring_size * sizeof(DmaCplEntry_t), &queue->cq_phys, GFP_KERNEL);
+        if (queue->cq_virt == NULL) {
+            dev_warn(dev, "%s - Failed to allocate completion queue %u, polling RING_HEAD\n", __func__, queue->id);
+        }
+    }
+    if (queue->cq_virt != NULL) {
+        writel(lower_32_bits(queue->cq_phys), queue->regs + PCIE_TEST_DEVICE_RING_CQ_ADDR_LOW);
+        writel(upper_32_bits(queue->cq_phys), queue->regs + PCIE_TEST_DEVICE_RING_CQ_ADDR_HI);
+        writel(queue->ring_size, queue->regs + PCIE_TEST_DEVICE_RING_CQ_SIZE);
+    } else {
+        writel(0, queue->regs + PCIE_TEST_DEVICE_RING_CQ_SIZE);
+    }
+
+    writel(coalesce_count, queue->regs + PCIE_TEST_DEVICE_RING_COAL_COUNT);
+    writel(coalesce_usec, queue->regs + PCIE_TEST_DEVICE_RING_COAL_USEC);
+
+    // Kicks only pay off where MMIO writes trap to a hypervisor, the kick is a plain write for the device
+    queue->shadow_tail = NULL;
+    if (pcie_device->shadow_virt != NULL) {
+        const size_t offset = queue->id * PCIE_TEST_DRIVER_SHADOW_STRIDE;
+        const dma_addr_t shadow_phys = pcie_device->shadow_phys + offset;
+
+        queue->shadow_tail = pcie_device->shadow_virt + offset;
+        queue->kick = pcie_device->bar0_mmio + PCIE_TEST_DEVICE_DOORBELL_OFFSET(queue->id) + PCIE_TEST_DEVICE_RING_KICK;
+        writel(lower_32_bits(shadow_phys), queue->regs + PCIE_TEST_DEVICE_RING_SHADOW_LOW);
+        writel(upper_32_bits(shadow_phys), queue->regs + PCIE_TEST_DEVICE_RING_SHADOW_HI);
+    }
+
+    pcie_ring_reset(queue);
+
+    if (log_level) {
+        dev_info(dev, "%s - Queue %u descriptor ring in %s, %u entries, completion queue %s\n", __func__, queue->id,
+                 (queue->ring_virt != NULL) ? "host memory" : "BAR0", queue->ring_size,
+                 (queue->cq_virt != NULL) ? "on" : "off");
+    }
+}
+
+static void pcie_ring_free(pcie_queue_t *queue)
+{
+    unsigned long flags;
+    LIST_HEAD(aborted);
+
+    spin_lock_irqsave(&queue->ring_lock, flags);
+    list_splice_init(&queue->ring_requests, &aborted);
+    spin_unlock_irqrestore(&queue->ring_lock, flags);
+    pcie_request_complete(&aborted, -ENODEV);
+
+    if (queue->shadow_tail != NULL) {
+        writel(0, queue->regs + PCIE_TEST_DEVICE_RING_SHADOW_LOW);
+        writel(0, queue->regs + PCIE_TEST_DEVICE_RING_SHADOW_HI);
+        queue->shadow_tail = NULL;
+    }
+    if (queue->cq_virt != NULL) {
+        writel(0, queue->regs + PCIE_TEST_DEVICE_RING_CQ_SIZE);
+        dma_free_coherent(&queue->pcie_device->pdev->dev, queue->ring_size * sizeof(DmaCplEntry_t),
+                          queue->cq_virt, queue->cq_phys);
+        queue->cq_virt = NULL;
+    }
+    if (queue->ring_virt != NULL) {
+        dma_free_coherent(&queue->pcie_device->pdev->dev, queue->ring_size * sizeof(DmaDescriptor_t),
+                          queue->ring_virt, queue->ring_phys);
+        queue->ring_virt = NULL;
+    }
+}
+
+// Hand an idle queue with a host ring and completion queue over to `pfile`. Userspace then posts descriptors and
+// rings the doorbell through its mappings of the queue, the driver keeps the queue interrupt masked and stops
+// using the queue until the file is closed. Descriptors carry raw bus addresses, hence CAP_SYS_RAWIO.
+static int pcie_queue_claim(pcie_file_t *pfile, dma_queue_info_t *info)
+{
+    pcie_device_t *pcie_device = pfile->pcie_device;
+    pcie_queue_t *queue = NULL;
+    unsigned long flags;
+
+    if (!capable(CAP_SYS_RAWIO)) {
+        return -EPERM;
+    }
+    if (PAGE_SIZE > PCIE_TEST_DEVICE_DOORBELL_STRIDE || pcie_device->virt_addr == NULL) {
+        return -EOPNOTSUPP;
+    }
+    if (pfile->queue != NULL) {
+        return -EBUSY;
+    }
+
+    // Queue 0 always stays with the driver
+    for (uint32_t q = pcie_device->num_queues - 1; q > 0 && queue == NULL; q--) {
+        pcie_queue_t *candidate = &pcie_device->queues[q];
+        if (candidate->ring_virt == NULL || candidate->cq_virt == NULL) {
+            continue;
+        }
+
+        spin_lock_irqsave(&candidate->ring_lock, flags);
+        pcie_ring_update_head(candidate);
+        if (candidate->owner == NULL && list_empty(&candidate->ring_requests)
+            && candidate->ring_submitted == candidate->ring_completed) {
+            candidate->owner = pfile;
+            queue = candidate;
+        }
+        spin_unlock_irqrestore(&candidate->ring_lock, flags);
+    }
+    if (queue == NULL) {
+        return -EBUSY;
+    }
+
+    spin_lock_irqsave(&pcie_device->int_mask_lock, flags);
+    pcie_device->int_claimed |= PCIE_TEST_DEVICE_INT_BIT(queue->id);
+    pcie_int_mask_update(pcie_device);
+    spin_unlock_irqrestore(&pcie_device->int_mask_lock, flags);
+
+    spin_lock_irqsave(&queue->ring_lock, flags);
+    pcie_ring_reset(queue);
+    spin_unlock_irqrestore(&queue->ring_lock, flags);
+    pfile->queue = queue;
+
+    info->queue = queue->id;
+    info->ring_size = queue->ring_size;
+    info->dma_buf_addr = pcie_device->phys_addr;
+    if (log_level) {
+        dev_info(pcie_device->device, "%s - Queue %u claimed for direct submission\n", __func__, queue->id);
+    }
+    return 0;
+}
+
+// Give the claimed queue of `pfile` back to the driver
+static void pcie_queue_unclaim(pcie_file_t *pfile)
+{
+    pcie_device_t *pcie_device = pfile->pcie_device;
+    pcie_queue_t *queue = pfile->queue;
+    unsigned long flags;
+
+    if (queue == NULL) {
+        return;
+    }
+
+    // Let the device finish what userspace posted, a queue stalled on a full completion queue never does
+    const unsigned long deadline = jiffies + msecs_to_jiffies(PCIE_TEST_DRIVER_RING_POLL_MS);
+    while (readl(queue->regs + PCIE_TEST_DEVICE_RING_HEAD) != readl(queue->regs + PCIE_TEST_DEVICE_RING_TAIL)) {
+        if (time_after(jiffies, deadline)) {
+            dev_warn(pcie_device->device, "%s - Queue %u did not drain, resetting it\n", __func__, queue->id);
+            break;
+        }
+        usleep_range(10, 100);
+    }
+
+    spin_lock_irqsave(&queue->ring_lock, flags);
+    pcie_ring_reset(queue);
+    queue->owner = NULL;
+    spin_unlock_irqrestore(&queue->ring_lock, flags);
+    pfile->queue = NULL;
+
+    // Drop what the queue latched while claimed before it can interrupt again
+    spin_lock_irqsave(&pcie_device->int_mask_lock, flags);
+    writel(PCIE_TEST_DEVICE_INT_BIT(queue->id), pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET);
+    pcie_device->int_claimed &= ~PCIE_TEST_DEVICE_INT_BIT(queue->id);
+    pcie_int_mask_update(pcie_device);
+    spin_unlock_irqrestore(&pcie_device->int_mask_lock, flags);
+}
+
+// Spread the CPUs over the queues, following the vector affinity when every queue has its own vector
+static int pcie_queue_map(pcie_device_t *pcie_device)
+{
+    struct pci_dev *pdev = pcie_device->pdev;
+    unsigned int cpu;
+
+    pcie_device->cpu_queue = kcalloc(nr_cpu_ids, sizeof(*pcie_device->cpu_queue), GFP_KERNEL);
+    if (pcie_device->cpu_queue == NULL) {
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        pcie_device->cpu_queue[cpu] = cpu % pcie_device->num_queues;
+    }
+
+    if (pdev->msix_enabled) {
+        for (uint32_t q = 0; q < pcie_device->num_queues; q++) {
+            const struct cpumask *mask = pci_irq_get_affinity(pdev, q);
+            if (mask == NULL) {
+                continue;
+            }
+            for_each_cpu(cpu, mask)
+            {
+                pcie_device->cpu_queue[cpu] = q;
+            }
+        }
+    }
+    return 0;
 }
 
 static int pcie_module_probe(struct pci_dev *pdev, const struct pci_device_id *pid)
@@ -325,6 +1694,18 @@ static int pcie_module_probe(struct pci_dev *pdev, const struct pci_device_id *p
 
     snprintf(pcie_device->name, sizeof(pcie_device->name), PCIE_TEST_KERNEL_DRIVER_NAME "%d", 0);
     pcie_device->pdev = pdev;
+    spin_lock_init(&pcie_device->files_lock);
+    spin_lock_init(&pcie_device->counter_lock);
+    INIT_LIST_HEAD(&pcie_device->files);
+    spin_lock_init(&pcie_device->int_mask_lock);
+    for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+        pcie_queue_t *queue = &pcie_device->queues[q];
+        queue->pcie_device = pcie_device;
+        queue->id = q;
+        spin_lock_init(&queue->ring_lock);
+        init_waitqueue_head(&queue->ring_wait);
+        INIT_LIST_HEAD(&queue->ring_requests);
+    }
     pci_set_drvdata(pdev, pcie_device);
 
     dev_dbg(dev, "%s - Enabling PCIe Device\n", __func__);
@@ -350,14 +1731,24 @@ static int pcie_module_probe(struct pci_dev *pdev, const struct pci_device_id *p
     start_addr = pci_resource_start(pdev, 0);
     len_bytes = pci_resource_len(pdev, 0);
     pcie_device->bar0_mmio = ioremap(start_addr, len_bytes);
+    pcie_device->mem_size = pci_resource_len(pdev, 1);
     if (!pcie_device->bar0_mmio) {
         dev_err(dev, "%s - cannot ioremap registers of size %lu\n", __func__, (unsigned long)len_bytes);
         goto ioremap_fail;
     }
     dev_dbg(dev, "%s - BAR0 (start: 0x%lx, len: %llu)\n", __func__, (unsigned long)pcie_device->bar0_mmio, len_bytes);
+    // Queues use their BAR0 descriptors until pcie_ring_init()
+    for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+        pcie_device->queues[q].regs = pcie_device->bar0_mmio + PCIE_TEST_DEVICE_RING_OFFSET(q);
+        pcie_device->queues[q].ring_size = PCIE_TEST_DEVICE_QUEUE_NUM_DESC;
+    }
 
-    // Set the DMA mask size (for both coherent and streaming DMA)
-    err = dma_set_mask_and_coherent(dev, DMA_BIT_MASK(32));
+    // Set the DMA mask size (for both coherent and streaming DMA). Descriptors and SGL entries carry 64-bit
+    // addresses, so pinned user pages anywhere in memory are mapped without bounce buffers.
+    err = dma_set_mask_and_coherent(dev, DMA_BIT_MASK(64));
+    if (err) {
+        err = dma_set_mask_and_coherent(dev, DMA_BIT_MASK(32));
+    }
     if (err) {
         dev_err(dev, "%s - error %d, failed to set dma mask\n", __func__, err);
         goto dma_set_mask_and_coherent_fail;
@@ -365,27 +1756,26 @@ static int pcie_module_probe(struct pci_dev *pdev, const struct pci_device_id *p
 
     /* Allocate and initialize shared control data (pci_allocate_coherent()) */
 
-    // Access device configuratin space
-    dev_dbg(dev, "%s - read version information: 0x%x\n", __func__,
-            readl(pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_VER_OFFSET));
-
-    // Request IRQ handler
-    dev_dbg(dev, "%s - Allocate interrupt vector\n", __func__);
-    err = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_ALL_TYPES);
-    if (err < 0) {
-        dev_err(dev, "%s - error %d, failed to allocate irq vector\n", __func__, err);
-        goto pci_alloc_irq_vectors_fail;
+    // A device of another major version has a different BAR0 layout
+    const uint32_t version = readl(pcie_device->bar0_mmio + PCIE_TEST_DEVICE_MMIO_VER_OFFSET);
+    dev_dbg(dev, "%s - read version information: 0x%x\n", __func__, version);
+    if (PCI_TEST_DEVICE_IP_VERSION_MAJOR(version) != PCI_TEST_DEVICE_IP_VERSION_MAJOR(PCI_TEST_DEVICE_IP_VERSION)) {
+        dev_err(dev, "%s - Unsupported device version 0x%x, expected 0x%x\n", __func__, version,
+                PCI_TEST_DEVICE_IP_VERSION);
+        err = -ENODEV;
+        goto version_check_fail;
     }
 
-    // Get IRQ number for vector 0
-    int irq = pci_irq_vector(pdev, 0);
-    if (log_level) {
-        dev_info(dev, "%s - Enable interrupt and register handler to IRQ %u\n", __func__, irq);
+    // Request IRQ handlers
+    dev_dbg(dev, "%s - Allocate interrupt vectors\n", __func__);
+    err = pcie_irq_init(pcie_device);
+    if (err) {
+        goto pcie_irq_init_fail;
     }
-    err = request_threaded_irq(irq, intHandlerHard, NULL, IRQF_SHARED, "PCIe test device interrupt", pcie_device);
+
+    err = pcie_queue_map(pcie_device);
     if (err) {
-        dev_err(dev, "%s - Failed to enable interrupt\n", __func__);
-        goto request_threaded_irq_fail;
+        goto pcie_queue_map_fail;
     }
 
     // Enable DMA/processing engines
@@ -393,13 +1783,31 @@ static int pcie_module_probe(struct pci_dev *pdev, const struct pci_device_id *p
     pci_set_master(pdev);
 
     // DMA buffer allocation
-    pcie_device->alloc_size = (((size_t)0x10000 + (((size_t)1 << PAGE_SHIFT) - 1)) >> PAGE_SHIFT) << PAGE_SHIFT;
-    pcie_device->virt_addr = dma_alloc_coherent(dev, pcie_device->alloc_size, &pcie_device->phys_addr, GFP_KERNEL);
+    // Buffers beyond the buddy allocator limit come from the CMA area, see the cma= boot parameter
+    pcie_device->alloc_size = PAGE_ALIGN(dma_buf_size);
+    pcie_device->virt_addr =
+        dma_alloc_coherent(dev, pcie_device->alloc_size, &pcie_device->phys_addr, GFP_KERNEL | __GFP_NOWARN);
+    if (pcie_device->virt_addr == NULL) {
+        dev_err(dev, "%s - Failed to allocate a %zu byte DMA buffer!\n", __func__, pcie_device->alloc_size);
+    }
     if (log_level) {
         dev_info(dev, "%s - Allocated buffer - virt addr: %p, phy addr: 0x%llx\n", __func__, pcie_device->virt_addr,
                  pcie_device->phys_addr);
     }
 
+    // Without the shadow page the queues write TAIL directly
+    if (kick_doorbell) {
+        pcie_device->shadow_virt = dma_alloc_coherent(dev, PAGE_SIZE, &pcie_device->shadow_phys, GFP_KERNEL);
+        if (pcie_device->shadow_virt == NULL) {
+            dev_warn(dev, "%s - Failed to allocate the shadow tails, writing TAIL directly\n", __func__);
+        }
+    }
+
+    // Descriptor rings next to the DMA buffer
+    for (uint32_t q = 0; q < pcie_device->num_queues; q++) {
+        pcie_ring_init(&pcie_device->queues[q]);
+    }
+
     // Allocate unique ID for device
     pcie_device->minor = ida_alloc(&g_device_ida, GFP_KERNEL);
     pcie_device->dev_number = MKDEV(MAJOR(g_base_dev), pcie_device->minor);
@@ -422,13 +1830,25 @@ static int pcie_module_probe(struct pci_dev *pdev, const struct pci_device_id *p
 
 cdev_add_fail:
     ida_free(&g_device_ida, pcie_device->minor);
-    dma_free_coherent(&pdev->dev, pcie_device->alloc_size, pcie_device->virt_addr, pcie_device->phys_addr);
-    pci_clear_master(pdev);
+    pcie_quiesce(pcie_device);
+    pcie_irq_free(pcie_device);
+    for (uint32_t q = 0; q < pcie_device->num_queues; q++) {
+        pcie_ring_free(&pcie_device->queues[q]);
+    }
+    if (pcie_device->shadow_virt != NULL) {
+        dma_free_coherent(&pdev->dev, PAGE_SIZE, pcie_device->shadow_virt, pcie_device->shadow_phys);
+    }
+    if (pcie_device->virt_addr != NULL) {
+        dma_free_coherent(&pdev->dev, pcie_device->alloc_size, pcie_device->virt_addr, pcie_device->phys_addr);
+    }
+    kfree(pcie_device->cpu_queue);
+    goto pcie_irq_init_fail;
 
-request_threaded_irq_fail:
-    pci_free_irq_vectors(pdev);
+pcie_queue_map_fail:
+    pcie_irq_free(pcie_device);
 
-pci_alloc_irq_vectors_fail:
+pcie_irq_init_fail:
+version_check_fail:
 dma_set_mask_and_coherent_fail:
 ioremap_fail:
     if (pcie_device->bar0_mmio) {
@@ -449,21 +1869,26 @@ static void pcie_module_remove(struct pci_dev *pdev)
 {
     struct device *dev = &pdev->dev;
 
-    dev_dbg(dev, "%s - Disable bus mastering\n", __func__);
-    pci_clear_master(pdev);
-
     pcie_device_t *pcie_device = pci_get_drvdata(pdev);
     if (pcie_device != NULL) {
+        dev_dbg(dev, "%s - Quiesce the device\n", __func__);
+        pcie_quiesce(pcie_device);
+        pcie_irq_free(pcie_device);
+
         if (pcie_device->virt_addr != NULL) {
             dev_dbg(dev, "%s - Freeing DMA Buffers\n", __func__);
             dma_free_coherent(&pdev->dev, pcie_device->alloc_size, pcie_device->virt_addr, pcie_device->phys_addr);
             pcie_device->virt_addr = NULL;
         }
-        int irq = pci_irq_vector(pdev, 0);
-        dev_dbg(dev, "%s - Remove interrupt handler for IRQ %u\n", __func__, irq);
-        free_irq(irq, pcie_device);
+        for (uint32_t q = 0; q < pcie_device->num_queues; q++) {
+            pcie_ring_free(&pcie_device->queues[q]);
+        }
+        if (pcie_device->shadow_virt != NULL) {
+            dma_free_coherent(&pdev->dev, PAGE_SIZE, pcie_device->shadow_virt, pcie_device->shadow_phys);
+            pcie_device->shadow_virt = NULL;
+        }
+        kfree(pcie_device->cpu_queue);
     }
-    pci_free_irq_vectors(pdev);
 
     dev_dbg(dev, "%s - Remving device\n", __func__);
     device_destroy(g_pcie_class, pcie_device->dev_number);
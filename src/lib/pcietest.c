@@ -0,0 +1,459 @@
+#include "pcietest.h"
+#include "pcie_device_regs.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CHAR_DEVICE_PATH "/dev/%s"
+
+// The DMA buffer is handed out in chunks, large buffers use larger chunks to bound the bookkeeping
+#define PCIETEST_MIN_CHUNK_SIZE 64
+#define PCIETEST_MAX_CHUNKS     65536
+#define PCIETEST_MAX_INFLIGHT   1024
+#define PCIETEST_REAP_SLICE     64
+
+struct pcietest {
+    int fd;
+    uint8_t *buf;
+    size_t buf_size;
+    uint64_t mem_size;
+    uint8_t *mem;
+
+    /* Async submission */
+    aio_context_t aio;
+    uint32_t max_inflight;
+    uint32_t inflight;
+
+    /* Allocations, the chunk count of an allocation is stored at its first chunk */
+    size_t chunk_size;
+    uint32_t num_chunks;
+    uint8_t *chunk_used;
+    uint32_t *chunk_count;
+
+    /* Claimed queue, doorbell is NULL until pcietest_queue_claim() */
+    volatile uint32_t *doorbell;
+    DmaDescriptor_t *ring;
+    volatile DmaCplEntry_t *cq;
+    uint32_t ring_size;
+    uint32_t ring_head; // Slot after the last completed descriptor
+    uint32_t ring_tail;
+    uint32_t cq_head;
+    uint32_t cq_phase;
+    uint64_t dma_buf_addr;
+    uint64_t *tokens; // Submission token per ring slot
+};
+
+pcietest_t *pcietest_open(const char *name, uint32_t max_inflight)
+{
+    char path[512];
+
+    if (max_inflight > PCIETEST_MAX_INFLIGHT) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pcietest_t *dev = calloc(1, sizeof(pcietest_t));
+    if (dev == NULL) {
+        return NULL;
+    }
+
+    if (strchr(name, '/') != NULL) {
+        snprintf(path, sizeof(path), "%s", name);
+    } else {
+        snprintf(path, sizeof(path), CHAR_DEVICE_PATH, name);
+    }
+
+    dev->fd = open(path, O_RDWR);
+    if (dev->fd < 0) {
+        goto open_fail;
+    }
+
+    dma_info_t info;
+    if (ioctl(dev->fd, PCIE_TEST_IOCTL_GET_INFO, &info) < 0) {
+        goto get_info_fail;
+    }
+    dev->buf_size = info.dma_buf_size;
+    dev->mem_size = info.dev_mem_size;
+
+    dev->chunk_size = PCIETEST_MIN_CHUNK_SIZE;
+    while (dev->buf_size / dev->chunk_size > PCIETEST_MAX_CHUNKS) {
+        dev->chunk_size *= 2;
+    }
+    dev->num_chunks = dev->buf_size / dev->chunk_size;
+    dev->chunk_used = calloc(dev->num_chunks, sizeof(uint8_t));
+    dev->chunk_count = calloc(dev->num_chunks, sizeof(uint32_t));
+    if (dev->chunk_used == NULL || dev->chunk_count == NULL) {
+        goto chunk_alloc_fail;
+    }
+
+    dev->buf = mmap(NULL, dev->buf_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (dev->buf == MAP_FAILED) {
+        goto mmap_fail;
+    }
+
+    // Optional, tools that only DMA keep working without it
+    dev->mem = mmap(NULL, dev->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, PCIE_TEST_MMAP_DEVICE_MEM);
+    if (dev->mem == MAP_FAILED) {
+        dev->mem = NULL;
+    }
+
+    if (max_inflight != 0 && syscall(SYS_io_setup, max_inflight, &dev->aio) < 0) {
+        goto io_setup_fail;
+    }
+    dev->max_inflight = max_inflight;
+    return dev;
+
+io_setup_fail:
+    if (dev->mem != NULL) {
+        munmap(dev->mem, dev->mem_size);
+    }
+    munmap(dev->buf, dev->buf_size);
+mmap_fail:
+chunk_alloc_fail:
+    free(dev->chunk_used);
+    free(dev->chunk_count);
+get_info_fail:
+    close(dev->fd);
+open_fail:
+    free(dev);
+    return NULL;
+}
+
+void pcietest_close(pcietest_t *dev)
+{
+    if (dev == NULL) {
+        return;
+    }
+
+    // Waits for what is still in flight
+    if (dev->max_inflight != 0) {
+        syscall(SYS_io_destroy, dev->aio);
+    }
+    // The driver takes the queue back once the file and these mappings are gone
+    if (dev->doorbell != NULL) {
+        munmap((void *)dev->doorbell, PCIE_TEST_DEVICE_DOORBELL_STRIDE);
+        munmap(dev->ring, dev->ring_size * sizeof(DmaDescriptor_t));
+        munmap((void *)dev->cq, dev->ring_size * sizeof(DmaCplEntry_t));
+        free(dev->tokens);
+    }
+    if (dev->mem != NULL) {
+        munmap(dev->mem, dev->mem_size);
+    }
+    munmap(dev->buf, dev->buf_size);
+    close(dev->fd);
+    free(dev->chunk_used);
+    free(dev->chunk_count);
+    free(dev);
+}
+
+int pcietest_fd(const pcietest_t *dev) { return dev->fd; }
+
+void *pcietest_buffer(const pcietest_t *dev) { return dev->buf; }
+
+size_t pcietest_buffer_size(const pcietest_t *dev) { return dev->buf_size; }
+
+uint64_t pcietest_device_size(const pcietest_t *dev) { return dev->mem_size; }
+
+void *pcietest_device_mem(const pcietest_t *dev) { return dev->mem; }
+
+// A full fence, it drains the write-combining buffers on x86 and orders device stores elsewhere
+void pcietest_device_flush(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+// First fit, a linear scan over at most PCIETEST_MAX_CHUNKS
+void *pcietest_alloc(pcietest_t *dev, size_t bytes, size_t align)
+{
+    if (bytes == 0 || bytes > dev->buf_size || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+
+    const uint32_t count = (bytes + dev->chunk_size - 1) / dev->chunk_size;
+    const uint32_t step = (align > dev->chunk_size) ? align / dev->chunk_size : 1;
+
+    for (uint32_t first = 0; first + count <= dev->num_chunks; first += step) {
+        uint32_t idx = 0;
+        while (idx < count && !dev->chunk_used[first + idx]) {
+            idx++;
+        }
+        if (idx < count) {
+            continue;
+        }
+
+        memset(&dev->chunk_used[first], 1, count);
+        dev->chunk_count[first] = count;
+        return dev->buf + (size_t)first * dev->chunk_size;
+    }
+    return NULL;
+}
+
+void pcietest_free(pcietest_t *dev, void *buf)
+{
+    if (buf == NULL) {
+        return;
+    }
+
+    const uint32_t first = pcietest_offset(dev, buf) / dev->chunk_size;
+    memset(&dev->chunk_used[first], 0, dev->chunk_count[first]);
+    dev->chunk_count[first] = 0;
+}
+
+uint64_t pcietest_offset(const pcietest_t *dev, const void *buf) { return (const uint8_t *)buf - dev->buf; }
+
+int pcietest_transfer(pcietest_t *dev, const dma_ctrl_t *ctrl, uint32_t poll_usec)
+{
+    return pcietest_batch(dev, ctrl, 1, NULL, poll_usec);
+}
+
+int pcietest_batch(pcietest_t *dev, const dma_ctrl_t *ctrls, uint32_t count, int32_t *status, uint32_t poll_usec)
+{
+    // A plain write waits for the batch, SUBMIT_BATCH is needed for polling or per-entry status
+    if (poll_usec == 0 && status == NULL) {
+        const ssize_t bytes = write(dev->fd, ctrls, count * sizeof(dma_ctrl_t));
+        return (bytes < 0) ? -errno : 0;
+    }
+
+    // SUBMIT_BATCH only waits with a poll budget, the smallest one sleeps on the interrupt right away
+    dma_batch_t batch = { .count = count,
+                          .poll_usec = (poll_usec != 0) ? poll_usec : 1,
+                          .entries = (uint64_t)(uintptr_t)ctrls,
+                          .status = (uint64_t)(uintptr_t)status };
+    return (ioctl(dev->fd, PCIE_TEST_IOCTL_SUBMIT_BATCH, &batch) < 0) ? -errno : 0;
+}
+
+int pcietest_user_transfer(pcietest_t *dev, const dma_user_ctrl_t *ctrl)
+{
+    return (ioctl(dev->fd, PCIE_TEST_IOCTL_USER_TRANSFER, ctrl) < 0) ? -errno : 0;
+}
+
+int pcietest_submit(pcietest_t *dev, const dma_ctrl_t *ctrls, uint32_t count, uint64_t token)
+{
+    if (dev->inflight == dev->max_inflight) {
+        return -EAGAIN;
+    }
+
+    // The driver copies the entries during io_submit, nothing has to outlive the call
+    struct iocb iocb = { .aio_lio_opcode = IOCB_CMD_PWRITE,
+                         .aio_fildes = dev->fd,
+                         .aio_buf = (uint64_t)(uintptr_t)ctrls,
+                         .aio_nbytes = count * sizeof(dma_ctrl_t),
+                         .aio_data = token };
+    struct iocb *iocbs[1] = { &iocb };
+    if (syscall(SYS_io_submit, dev->aio, 1, iocbs) != 1) {
+        return -errno;
+    }
+    dev->inflight++;
+    return 0;
+}
+
+int pcietest_reap(pcietest_t *dev, pcietest_cpl_t *cpls, uint32_t min, uint32_t max)
+{
+    struct io_event events[PCIETEST_REAP_SLICE];
+    uint32_t reaped = 0;
+
+    if (min > dev->inflight) {
+        min = dev->inflight;
+    }
+
+    // Events are fetched in slices of the stack array
+    while (reaped < max) {
+        const uint32_t want = (max - reaped < PCIETEST_REAP_SLICE) ? max - reaped : PCIETEST_REAP_SLICE;
+        const uint32_t need = (min > reaped) ? ((min - reaped < want) ? min - reaped : want) : 0;
+        struct timespec no_wait = { 0 };
+
+        const long num = syscall(SYS_io_getevents, dev->aio, need, want, events, (need == 0) ? &no_wait : NULL);
+        if (num < 0) {
+            return (reaped != 0) ? (int)reaped : -errno;
+        }
+
+        for (long idx = 0; idx < num; idx++) {
+            cpls[reaped + idx].token = events[idx].data;
+            cpls[reaped + idx].value = 0;
+            cpls[reaped + idx].result = (events[idx].res < 0) ? events[idx].res : 0;
+        }
+        reaped += num;
+        dev->inflight -= num;
+
+        // Everything that was ready is reaped and `min` is met
+        if (num < want) {
+            break;
+        }
+    }
+    return reaped;
+}
+
+uint32_t pcietest_inflight(const pcietest_t *dev) { return dev->inflight; }
+
+int pcietest_wait_interrupt(pcietest_t *dev, uint32_t *irq_count)
+{
+    struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+
+    if (poll(&pfd, 1, -1) < 0) {
+        return -errno;
+    }
+    if (read(dev->fd, irq_count, sizeof(*irq_count)) != sizeof(*irq_count)) {
+        return -EIO;
+    }
+    return 0;
+}
+
+int pcietest_queue_claim(pcietest_t *dev)
+{
+    dma_queue_info_t info;
+
+    if (dev->doorbell != NULL) {
+        return -EBUSY;
+    }
+    if (ioctl(dev->fd, PCIE_TEST_IOCTL_CLAIM_QUEUE, &info) < 0) {
+        return -errno;
+    }
+
+    // The queue stays claimed until the handle is closed, a failed mapping leaves it unused until then
+    const size_t ring_bytes = info.ring_size * sizeof(DmaDescriptor_t);
+    const size_t cq_bytes = info.ring_size * sizeof(DmaCplEntry_t);
+    void *doorbell = mmap(NULL, PCIE_TEST_DEVICE_DOORBELL_STRIDE, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd,
+                          PCIE_TEST_MMAP_DOORBELL);
+    void *ring = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, PCIE_TEST_MMAP_RING);
+    void *cq = mmap(NULL, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, PCIE_TEST_MMAP_CQ);
+    uint64_t *tokens = calloc(info.ring_size, sizeof(uint64_t));
+    if (doorbell == MAP_FAILED || ring == MAP_FAILED || cq == MAP_FAILED || tokens == NULL) {
+        const int err = (tokens == NULL) ? -ENOMEM : -errno;
+        if (doorbell != MAP_FAILED) {
+            munmap(doorbell, PCIE_TEST_DEVICE_DOORBELL_STRIDE);
+        }
+        if (ring != MAP_FAILED) {
+            munmap(ring, ring_bytes);
+        }
+        if (cq != MAP_FAILED) {
+            munmap(cq, cq_bytes);
+        }
+        free(tokens);
+        return err;
+    }
+
+    dev->doorbell = doorbell;
+    dev->ring = ring;
+    dev->cq = cq;
+    dev->tokens = tokens;
+    dev->ring_size = info.ring_size;
+    dev->ring_head = 0;
+    dev->ring_tail = 0;
+    dev->cq_head = 0;
+    dev->cq_phase = 1;
+    dev->dma_buf_addr = info.dma_buf_addr;
+    return 0;
+}
+
+static bool pcietest_in_range(const uint64_t size, const uint64_t addr, const uint32_t bytes)
+{
+    return addr <= size && bytes <= size - addr;
+}
+
+// Same checks as the driver, the device trusts the bus addresses it is given
+static bool pcietest_ctrl_valid(const pcietest_t *dev, const dma_ctrl_t *ctrl)
+{
+    switch (ctrl->op_code) {
+    case TEST_DEVICE_DMA_COPY:
+        return pcietest_in_range(dev->mem_size, ctrl->src, ctrl->bytes)
+               && pcietest_in_range(dev->mem_size, ctrl->dst, ctrl->bytes);
+    case TEST_DEVICE_DMA_FILL:
+    case TEST_DEVICE_DMA_COMPARE:
+        // src is the pattern
+        return pcietest_in_range(dev->mem_size, ctrl->dst, ctrl->bytes);
+    default: {
+        const bool isToDevice = PCIE_TEST_DEVICE_DMA_IS_TO_DEVICE(ctrl->op_code);
+        return PCIE_TEST_DEVICE_DMA_IS_HOST(ctrl->op_code)
+               && pcietest_in_range(dev->buf_size, isToDevice ? ctrl->src : ctrl->dst, ctrl->bytes)
+               && pcietest_in_range(dev->mem_size, isToDevice ? ctrl->dst : ctrl->src, ctrl->bytes);
+    }
+    }
+}
+
+int pcietest_queue_submit(pcietest_t *dev, const dma_ctrl_t *ctrls, uint32_t count, uint64_t token)
+{
+    if (dev->doorbell == NULL) {
+        return -EINVAL;
+    }
+
+    const uint32_t used = (dev->ring_tail - dev->ring_head + dev->ring_size) % dev->ring_size;
+    if (count > dev->ring_size - 1 - used) {
+        return -EBUSY;
+    }
+
+    for (uint32_t idx = 0; idx < count; idx++) {
+        if (!pcietest_ctrl_valid(dev, &ctrls[idx])) {
+            return -EINVAL;
+        }
+    }
+
+    for (uint32_t idx = 0; idx < count; idx++) {
+        const dma_ctrl_t *ctrl = &ctrls[idx];
+        const bool isHost = PCIE_TEST_DEVICE_DMA_IS_HOST(ctrl->op_code);
+        const bool isToDevice = PCIE_TEST_DEVICE_DMA_IS_TO_DEVICE(ctrl->op_code);
+        const uint64_t src = (isHost && isToDevice) ? dev->dma_buf_addr + ctrl->src : ctrl->src;
+        const uint64_t dst = (isHost && !isToDevice) ? dev->dma_buf_addr + ctrl->dst : ctrl->dst;
+        DmaDescCtrl_t descCtrl = { 0 };
+        descCtrl.bits.type = ctrl->op_code;
+
+        dev->ring[dev->ring_tail] = (DmaDescriptor_t){ .srcAddrHi = src >> 32,
+                                                       .srcAddrLow = (uint32_t)src,
+                                                       .dstAddrHi = dst >> 32,
+                                                       .dstAddrLow = (uint32_t)dst,
+                                                       .txSize = ctrl->bytes,
+                                                       .ctrl = descCtrl.all };
+        dev->tokens[dev->ring_tail] = token;
+        dev->ring_tail = PCIE_TEST_DEVICE_RING_NEXT(dev->ring_tail, dev->ring_size);
+    }
+
+    // Descriptors must be visible before the doorbell
+    pcietest_device_flush();
+    dev->doorbell[PCIE_TEST_DEVICE_RING_TAIL / sizeof(uint32_t)] = dev->ring_tail;
+    return 0;
+}
+
+int pcietest_queue_reap(pcietest_t *dev, pcietest_cpl_t *cpls, uint32_t max)
+{
+    uint32_t reaped = 0;
+
+    if (dev->doorbell == NULL) {
+        return -EINVAL;
+    }
+
+    while (reaped < max) {
+        volatile DmaCplEntry_t *entry = &dev->cq[dev->cq_head];
+        const DmaCplStatus_t status = { .all = entry->status };
+        if (status.bits.phase != dev->cq_phase) {
+            break;
+        }
+
+        // Only read the rest of the entry after the phase says it is complete
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        const uint32_t slot = entry->descId;
+        cpls[reaped].token = dev->tokens[slot];
+        cpls[reaped].value = entry->result;
+        cpls[reaped].result = status.bits.error ? -EIO : 0;
+        reaped++;
+
+        dev->ring_head = PCIE_TEST_DEVICE_RING_NEXT(slot, dev->ring_size);
+        dev->cq_head = PCIE_TEST_DEVICE_RING_NEXT(dev->cq_head, dev->ring_size);
+        if (dev->cq_head == 0) {
+            dev->cq_phase ^= 1;
+        }
+    }
+
+    // Hand the entries back with a single doorbell write
+    if (reaped != 0) {
+        dev->doorbell[PCIE_TEST_DEVICE_RING_CQ_HEAD / sizeof(uint32_t)] = dev->cq_head;
+    }
+    return reaped;
+}
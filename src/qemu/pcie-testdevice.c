@@ -15,7 +15,19 @@
 #include "qemu/osdep.h"
 #include "qom/object.h"
 
+#include "block/aio.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "qemu/crc32c.h"
+#include "qemu/event_notifier.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
 
 #include "hw/irq.h"
 #include "hw/pci/msix.h"
@@ -24,9 +36,17 @@
 #include "hw/pci/pcie_port.h"
 #include "hw/qdev-properties-system.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "system/hostmem.h"
+#include "system/iothread.h"
+#include "system/runstate.h"
 
 #include "hw/misc/pcie_device_regs.h"
 
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
 /* QEMU Device Definitions */
 #define TYPE_PCIE_TEST_DEVICE        "pcie-test-device"
 #define PCIE_TEST_DEVICE_VID         PCI_VENDOR_ID_QEMU
@@ -37,13 +57,24 @@
 
 /* Interrupts */
 #define PCIE_TEST_DEVICE_INTERRUPT_PIN 1
-#define PCIE_TEST_DEVICE_MSIX_VECTORS  1
+#define PCIE_TEST_DEVICE_MSIX_VECTORS  PCIE_TEST_DEVICE_NUM_VECTORS
 #define PCIE_TEST_DEVICE_MSIX_BAR      3
 
 /* Helpers */
 #define INTERNAL_REG_OFFSET(i)  ((i) >> 2)
 #define CTRL_REGS(reg, offset)  (reg[INTERNAL_REG_OFFSET(offset)])
 #define DMA_REG(reg, i, offset) (reg[INTERNAL_REG_OFFSET(PCIE_TEST_DEVICE_DESC_OFFSET(i) + offset)])
+#define RING_REG(reg, q, offset) (reg[INTERNAL_REG_OFFSET(PCIE_TEST_DEVICE_RING_OFFSET(q) + offset)])
+
+/* Descriptors and scatter-gather entries pulled from host memory with a single DMA read */
+#define PCIE_TEST_DEVICE_DESC_FETCH_BATCH 16
+#define PCIE_TEST_DEVICE_SGL_FETCH_BATCH  32
+
+/* BAR1 scrub pattern, repeats every 256 bytes */
+#define PCIE_TEST_DEVICE_SCRUB_PATTERN_BYTES 256
+
+/* Link model: framing + sequence number + 4DW header + LCRC per TLP */
+#define PCIE_TEST_DEVICE_TLP_OVERHEAD_BYTES 24
 
 /* Toggle to debug print */
 //#define DEBUG
@@ -54,35 +85,96 @@
 #define DEBUG_PRINT(fmt, ...)
 #endif
 
-typedef struct PcieTestDevice {
+typedef struct PcieTestDevice PcieTestDevice;
+
+/* One DMA queue, runs its descriptor ring on its own thread and completes on its own vector */
+typedef struct PcieTestDeviceQueue {
+    PcieTestDevice *dev;
+    uint32_t id;
+    QemuThread thread;
+    QemuMutex lock; /* Protects the queue's ring registers and BAR0 descriptor slots */
+    QemuCond cond;
+    QemuCond idleCond; /* Signalled when the thread leaves the ring, see active */
+    bool busy;         /* Doorbell rung and ring not drained yet, reported in STATUS */
+    bool active;       /* Thread is working the ring, protected by lock */
+    uint32_t ringGen;  /* Bumped by RING_CTRL, protected by lock */
+
+    /* Completion queue write pointer, protected by lock */
+    uint32_t cqTail;
+    bool cqPhase;
+
+    /* Interrupt coalescing, protected by lock */
+    uint32_t coalPending; /* Completions not signalled yet */
+    QEMUTimer *coalTimer; /* Fires COAL_USEC after the first pending completion */
+
+    EventNotifier kick; /* RING_KICK of the doorbell page as an ioeventfd */
+} PcieTestDeviceQueue;
+
+struct PcieTestDevice {
     PCIDevice parentPci;
 
     /* PCIe BARs*/
     MemoryRegion bar0; /* BAR0 MMIO device registers */
     uint32_t regs[PCIE_TEST_DEVICE_MIMO_MAX_SIZE_DWORDS];
 
-    MemoryRegion mem; /* BAR1 */
+    MemoryRegion mem;        /* BAR1 RAM when no memdev is given */
+    MemoryRegion *memRegion; /* BAR1, either `mem` or the memdev region */
+
+    /* DMA engine, the queues run their descriptor rings off the vCPU thread */
+    PcieTestDeviceQueue queues[PCIE_TEST_DEVICE_NUM_QUEUES];
+    bool dmaStopping;
+    bool dmaPaused; /* VM stopped, the queues finish their current descriptor and wait */
+    VMChangeStateEntry *vmStateEntry;
+    QEMUBH *completionBh; /* Raises the completion interrupt from the main loop */
+    uint32_t pendingIrq;  /* INT_STATUS bits the completion BH still has to raise */
+
+    /* Performance counters, the DMA threads update them without a lock */
+    Stat64 counters[TEST_DEVICE_NUM_COUNTERS];
+    uint64_t counterSnapshot[TEST_DEVICE_NUM_COUNTERS]; /* Taken by a LOW read under the BQL */
+    uint64_t counterState[TEST_DEVICE_NUM_COUNTERS];    /* Counter values in the migration stream */
+
+    /* Link timing model, the link is shared by all queues */
+    QemuMutex linkLock;
+    QemuCond linkCond;
+    QEMUTimer *linkTimer;  /* Wakes the DMA threads once the link transferred the data */
+    int64_t linkBusyUntil; /* QEMU_CLOCK_VIRTUAL time the link becomes idle, protected by linkLock */
 
     /* Device Properties */
     PCIExpLinkSpeed speed;
     PCIExpLinkWidth width;
-} PcieTestDevice;
+    bool linkModel;
+    uint32_t linkMaxPayload;
+    uint32_t linkLatencyNs;
+    uint64_t memSize;
+    HostMemoryBackend *memdev;
+    bool ioeventfd;
+    IOThread *iothread; /* Handles the doorbell kicks, the main loop does without it */
+};
 
 OBJECT_DECLARE_SIMPLE_TYPE(PcieTestDevice, PCIE_TEST_DEVICE);
 
 static const Property pcie_props[] = {
     DEFINE_PROP_PCIE_LINK_SPEED("x-speed", PcieTestDevice, speed, PCIE_LINK_SPEED_2_5),
     DEFINE_PROP_PCIE_LINK_WIDTH("x-width", PcieTestDevice, width, PCIE_LINK_WIDTH_16),
+    DEFINE_PROP_BOOL("x-link-model", PcieTestDevice, linkModel, false),
+    DEFINE_PROP_UINT32("x-max-payload", PcieTestDevice, linkMaxPayload, 256),
+    DEFINE_PROP_UINT32("x-dma-latency-ns", PcieTestDevice, linkLatencyNs, 1000),
+    DEFINE_PROP_SIZE("x-mem-size", PcieTestDevice, memSize, PCIE_TEST_DEVICE_BUFF_SIZE_BYTES),
+    DEFINE_PROP_LINK("memdev", PcieTestDevice, memdev, TYPE_MEMORY_BACKEND, HostMemoryBackend *),
+    DEFINE_PROP_BOOL("x-ioeventfd", PcieTestDevice, ioeventfd, true),
+    DEFINE_PROP_LINK("iothread", PcieTestDevice, iothread, TYPE_IOTHREAD, IOThread *),
 };
 
-static void pcie_test_device_assert_interrupt(PcieTestDevice *dev)
+static void pcie_test_device_assert_interrupt(PcieTestDevice *dev, const uint32_t vector)
 {
     // Check if interrupt mask is enabled
-    DeviceIntMask_t intMask = { .all = CTRL_REGS(dev->regs, PCIE_TEST_DEVICE_MMIO_INT_MASK_OFFSET) };
-    if (intMask.bits.mask_0) {
+    const uint32_t intMask = CTRL_REGS(dev->regs, PCIE_TEST_DEVICE_MMIO_INT_MASK_OFFSET);
+    if (intMask & PCIE_TEST_DEVICE_INT_BIT(vector)) {
+        stat64_add(&dev->counters[TEST_DEVICE_CNT_IRQS], 1);
+
         bool isMsixEnabled = msix_enabled(PCI_DEVICE(dev));
         if (isMsixEnabled) {
-            msix_notify(PCI_DEVICE(dev), 0);
+            msix_notify(PCI_DEVICE(dev), vector);
         } else {
             DEBUG_PRINT("%s - Trigger legacy interrupt\n", __func__);
             pci_irq_assert(PCI_DEVICE(dev));
@@ -90,89 +182,823 @@ static void pcie_test_device_assert_interrupt(PcieTestDevice *dev)
     }
 }
 
-static void pcie_test_device_start_transfer(PcieTestDevice *dev, const uint8_t descId, const bool isTrigger)
+static uint32_t pcie_test_device_cq_size(PcieTestDeviceQueue *queue)
 {
-    DeviceCtrl_t ctrl = { .all = CTRL_REGS(dev->regs, PCIE_TEST_DEVICE_MMIO_CTRL_OFFSET) };
-    if (!ctrl.bits.start) {
-        return;
+    const uint32_t size = RING_REG(queue->dev->regs, queue->id, PCIE_TEST_DEVICE_RING_CQ_SIZE);
+    return (size <= PCIE_TEST_DEVICE_RING_MAX_SIZE) ? size : 0;
+}
+
+// With MSI-X a queue writing completion entries is signalled through its vector only,
+// so the host does not have to read and clear INT_STATUS
+static bool pcie_test_device_is_latched(PcieTestDevice *dev, const uint32_t vector)
+{
+    return !msix_enabled(PCI_DEVICE(dev)) || vector >= PCIE_TEST_DEVICE_NUM_QUEUES
+           || pcie_test_device_cq_size(&dev->queues[vector]) == 0;
+}
+
+// Latch `intBits` in INT_STATUS and signal each of their vectors
+static void pcie_test_device_raise_interrupts(PcieTestDevice *dev, uint32_t intBits)
+{
+    intBits &= PCIE_TEST_DEVICE_INT_ALL;
+
+    const uint32_t intMask = CTRL_REGS(dev->regs, PCIE_TEST_DEVICE_MMIO_INT_MASK_OFFSET);
+    for (uint32_t vector = 0; vector < PCIE_TEST_DEVICE_NUM_VECTORS; vector++) {
+        if (!(intBits & PCIE_TEST_DEVICE_INT_BIT(vector))) {
+            continue;
+        }
+
+        // A masked vector stays pending in INT_STATUS until it is unmasked
+        const bool isMasked = !(intMask & PCIE_TEST_DEVICE_INT_BIT(vector));
+        if (isMasked || pcie_test_device_is_latched(dev, vector)) {
+            CTRL_REGS(dev->regs, PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET) |= PCIE_TEST_DEVICE_INT_BIT(vector);
+        }
+        pcie_test_device_assert_interrupt(dev, vector);
+    }
+}
+
+// Move `len` bytes between `buf` and host memory the way pci_dma_rw() does, but only to and from RAM. The DMA threads
+// never need the BQL this way, so the device can wait for them while holding it.
+static MemTxResult pcie_test_device_dma_rw(PcieTestDevice *dev, dma_addr_t addr, void *buf, dma_addr_t len,
+                                           const DMADirection dir)
+{
+    AddressSpace *as = pci_get_address_space(PCI_DEVICE(dev));
+    const bool isWrite = (dir == DMA_DIRECTION_FROM_DEVICE);
+    uint8_t *ptr = buf;
+
+    smp_mb();
+
+    RCU_READ_LOCK_GUARD();
+    while (len != 0) {
+        hwaddr xlat;
+        hwaddr chunk = len;
+        MemoryRegion *mr = address_space_translate(as, addr, &xlat, &chunk, isWrite, MEMTXATTRS_UNSPECIFIED);
+        if (!memory_region_is_ram(mr) || memory_region_is_ram_device(mr) || (isWrite && memory_region_is_rom(mr))) {
+            DEBUG_PRINT("%s - DMA to 0x%" PRIx64 " is not backed by RAM!\n", __func__, addr);
+            return MEMTX_DECODE_ERROR;
+        }
+
+        uint8_t *ram = (uint8_t *)memory_region_get_ram_ptr(mr) + xlat;
+        if (isWrite) {
+            memmove(ram, ptr, chunk);
+            memory_region_set_dirty(mr, xlat, chunk);
+        } else {
+            memmove(ptr, ram, chunk);
+        }
+        addr += chunk;
+        ptr += chunk;
+        len -= chunk;
+    }
+    return MEMTX_OK;
+}
+
+static bool pcie_test_device_mem_in_range(PcieTestDevice *dev, const dma_addr_t addr, const dma_addr_t len)
+{
+    return (addr <= dev->memSize) && (len <= (dev->memSize - addr));
+}
+
+// Move `len` bytes between host memory and the device memory offset `devAddr`
+static MemTxResult pcie_test_device_dma_host(PcieTestDevice *dev, const bool isToDevice, const dma_addr_t hostAddr,
+                                             const dma_addr_t devAddr, const dma_addr_t len)
+{
+    uint8_t *pRam = memory_region_get_ram_ptr(dev->memRegion);
+    if (isToDevice) {
+        // Stores through the RAM pointer bypass dirty logging, live migration has to resend the pages
+        const MemTxResult dmaResult =
+            pcie_test_device_dma_rw(dev, hostAddr, &pRam[devAddr], len, DMA_DIRECTION_TO_DEVICE);
+        memory_region_set_dirty(dev->memRegion, devAddr, len);
+        return dmaResult;
+    }
+    return pcie_test_device_dma_rw(dev, hostAddr, &pRam[devAddr], len, DMA_DIRECTION_FROM_DEVICE);
+}
+
+#if defined(__x86_64__)
+static uint32_t __attribute__((target("sse4.2"))) pcie_test_device_crc32c_sse42(uint32_t crc, const uint8_t *data,
+                                                                                uint64_t len)
+{
+    for (; len >= sizeof(uint64_t); data += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        crc = _mm_crc32_u64(crc, value);
     }
+    for (; len > 0; data++, len--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
 
-    if (ctrl.bits.type > TEST_DEVICE_DMA_WRITE) {
+// CRC32C of `len` bytes, with the CRC32 instruction of SSE 4.2 where the host has it
+static uint32_t pcie_test_device_crc32c(const uint8_t *data, uint64_t len)
+{
+    uint32_t crc = UINT32_MAX;
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return pcie_test_device_crc32c_sse42(crc, data, len) ^ UINT32_MAX;
+    }
+#endif
+    // crc32c() takes a 32-bit length
+    while (len > 0) {
+        const uint32_t chunk = MIN(len, UINT32_MAX);
+        crc = crc32c(crc, data, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+    return crc ^ UINT32_MAX;
+}
+
+// Walk a scatter-gather list in host memory until `len` bytes have been moved
+static MemTxResult pcie_test_device_dma_sgl(PcieTestDevice *dev, const bool isToDevice, dma_addr_t sglAddr,
+                                            uint32_t numEntries, dma_addr_t devAddr, dma_addr_t len)
+{
+    DmaSglEntry_t sgl[PCIE_TEST_DEVICE_SGL_FETCH_BATCH];
+    uint32_t numVisited = 0;
+
+    while (len > 0) {
+        // Bound the walk so a looping chain cannot stall the engine
+        if (numEntries == 0 || numVisited >= PCIE_TEST_DEVICE_SGL_MAX_ENTRIES) {
+            DEBUG_PRINT("%s - Scatter-gather list shorter than transfer!\n", __func__);
+            return MEMTX_DECODE_ERROR;
+        }
+
+        const uint32_t count = MIN(numEntries, PCIE_TEST_DEVICE_SGL_FETCH_BATCH);
+        MemTxResult dmaResult =
+            pcie_test_device_dma_rw(dev, sglAddr, sgl, count * sizeof(DmaSglEntry_t), DMA_DIRECTION_TO_DEVICE);
+        if (dmaResult != MEMTX_OK) {
+            return dmaResult;
+        }
+
+        bool isChained = false;
+        for (uint32_t i = 0; i < count && len > 0; i++) {
+            const dma_addr_t addr = ((dma_addr_t)le32_to_cpu(sgl[i].addrHi) << 32) | le32_to_cpu(sgl[i].addrLow);
+            const uint32_t entryLen = le32_to_cpu(sgl[i].len);
+            DmaSglFlags_t flags = { .all = le32_to_cpu(sgl[i].flags) };
+            numVisited++;
+
+            if (flags.bits.chain) {
+                sglAddr = addr;
+                numEntries = entryLen;
+                isChained = true;
+                break;
+            }
+
+            const dma_addr_t chunk = MIN(entryLen, len);
+            dmaResult = pcie_test_device_dma_host(dev, isToDevice, addr, devAddr, chunk);
+            if (dmaResult != MEMTX_OK) {
+                return dmaResult;
+            }
+            devAddr += chunk;
+            len -= chunk;
+        }
+
+        if (!isChained) {
+            sglAddr += count * sizeof(DmaSglEntry_t);
+            numEntries -= count;
+        }
+    }
+    return MEMTX_OK;
+}
+
+// Repeat the first `patternLen` bytes at `pRam` over `len` bytes, doubling the filled part with every memcpy()
+static void pcie_test_device_repeat(uint8_t *pRam, const uint64_t patternLen, const uint64_t len)
+{
+    for (uint64_t filled = patternLen; filled < len; filled *= 2) {
+        memcpy(&pRam[filled], pRam, MIN(filled, len - filled));
+    }
+}
+
+// Offset of the first of `len` bytes at `pRam` that differs from the repeated `pattern`, `len` if none does
+static uint64_t pcie_test_device_compare(const uint8_t *pRam, const uint8_t *pattern, const uint64_t len)
+{
+    const uint64_t patternLen = MIN(len, sizeof(uint64_t));
+
+    for (uint64_t idx = 0; idx < patternLen; idx++) {
+        if (pRam[idx] != pattern[idx]) {
+            return idx;
+        }
+    }
+
+    // The checked part repeats the pattern, so the next part has to repeat the checked one
+    for (uint64_t checked = patternLen; checked < len; checked *= 2) {
+        const uint64_t chunk = MIN(checked, len - checked);
+        if (memcmp(&pRam[checked], pRam, chunk) == 0) {
+            continue;
+        }
+        for (uint64_t idx = 0; idx < chunk; idx++) {
+            if (pRam[checked + idx] != pRam[idx]) {
+                return checked + idx;
+            }
+        }
+    }
+    return len;
+}
+
+// Operations within device memory, nothing crosses the link
+static MemTxResult pcie_test_device_run_local(PcieTestDevice *dev, const DmaDescriptor_t *desc, uint64_t *result)
+{
+    DmaDescCtrl_t descCtrl = { .all = desc->ctrl };
+    uint8_t *pRam = memory_region_get_ram_ptr(dev->memRegion);
+    const uint64_t src = ((uint64_t)desc->srcAddrHi << 32) | desc->srcAddrLow;
+    const uint64_t dst = ((uint64_t)desc->dstAddrHi << 32) | desc->dstAddrLow;
+    const uint64_t len = desc->txSize;
+    uint8_t pattern[sizeof(uint64_t)];
+
+    if (!pcie_test_device_mem_in_range(dev, dst, len)
+        || (descCtrl.bits.type == TEST_DEVICE_DMA_COPY && !pcie_test_device_mem_in_range(dev, src, len))) {
+        DEBUG_PRINT("%s - Device address out of range!\n", __func__);
+        return MEMTX_DECODE_ERROR;
+    }
+
+    // FILL and COMPARE carry the pattern in the source address
+    stq_le_p(pattern, src);
+
+    switch (descCtrl.bits.type) {
+    case TEST_DEVICE_DMA_COPY:
+        memmove(&pRam[dst], &pRam[src], len);
+        break;
+    case TEST_DEVICE_DMA_FILL:
+        memcpy(&pRam[dst], pattern, MIN(len, sizeof(pattern)));
+        pcie_test_device_repeat(&pRam[dst], MIN(len, sizeof(pattern)), len);
+        break;
+    case TEST_DEVICE_DMA_COMPARE:
+        *result = pcie_test_device_compare(&pRam[dst], pattern, len);
+        return MEMTX_OK;
+    }
+    memory_region_set_dirty(dev->memRegion, dst, len);
+    return MEMTX_OK;
+}
+
+// `result` receives the operation specific result for the completion entry
+static MemTxResult pcie_test_device_run_desc(PcieTestDevice *dev, const DmaDescriptor_t *desc, uint64_t *result)
+{
+    DmaDescCtrl_t descCtrl = { .all = desc->ctrl };
+    *result = 0;
+    if (descCtrl.bits.type > TEST_DEVICE_DMA_COMPARE) {
         DEBUG_PRINT("%s - Invalid dma type!\n", __func__);
-        return;
+        return MEMTX_ERROR;
+    }
+    if (!PCIE_TEST_DEVICE_DMA_IS_HOST(descCtrl.bits.type)) {
+        return pcie_test_device_run_local(dev, desc, result);
     }
 
     DEBUG_PRINT("%s - Setting up DMA transfer\n", __func__);
 
-    PCIDevice *pci_dev = PCI_DEVICE(dev);
-    dma_addr_t src_addr = ((dma_addr_t)DMA_REG(dev->regs, descId, PCIE_TEST_DEVICE_DESC_SRC_ADDR_HI) << 32)
-                          | ((dma_addr_t)DMA_REG(dev->regs, descId, PCIE_TEST_DEVICE_DESC_SRC_ADDR_LOW));
-    dma_addr_t dst_addr = ((dma_addr_t)DMA_REG(dev->regs, descId, PCIE_TEST_DEVICE_DESC_DST_ADDR_HI) << 32)
-                          | ((dma_addr_t)DMA_REG(dev->regs, descId, PCIE_TEST_DEVICE_DESC_DST_ADDR_LOW));
-    dma_addr_t dma_len = DMA_REG(dev->regs, descId, PCIE_TEST_DEVICE_DESC_TX_SIZE);
+    dma_addr_t src_addr = ((dma_addr_t)desc->srcAddrHi << 32) | ((dma_addr_t)desc->srcAddrLow);
+    dma_addr_t dst_addr = ((dma_addr_t)desc->dstAddrHi << 32) | ((dma_addr_t)desc->dstAddrLow);
+    dma_addr_t dma_len = desc->txSize;
 
     DEBUG_PRINT("%s - Descriptor src: 0x%" PRIx64 ", dst 0x%" PRIx64 ", "
                 "len %" PRIu64 "\n",
                 __func__, src_addr, dst_addr, dma_len);
 
-    // Set device busy
-    DeviceStatus_t deviceStatus = { .all = CTRL_REGS(dev->regs, PCIE_TEST_DEVICE_MMIO_STATUS_OFFSET) };
-    deviceStatus.bits.busy_0 = 1;
-    CTRL_REGS(dev->regs, PCIE_TEST_DEVICE_MMIO_STATUS_OFFSET) = deviceStatus.all;
+    // Host -> device reads from src, device -> host writes to dst
+    const bool isToDevice = PCIE_TEST_DEVICE_DMA_IS_TO_DEVICE(descCtrl.bits.type);
+    const dma_addr_t host_addr = isToDevice ? src_addr : dst_addr;
+    const dma_addr_t dev_addr = isToDevice ? dst_addr : src_addr;
+    if (!pcie_test_device_mem_in_range(dev, dev_addr, dma_len)) {
+        DEBUG_PRINT("%s - Device address out of range!\n", __func__);
+        return MEMTX_DECODE_ERROR;
+    }
 
-    MemTxResult dmaResult = MEMTX_OK;
-    volatile uint8_t *pRam = memory_region_get_ram_ptr(&dev->mem);
-    switch (ctrl.bits.type) {
-    case TEST_DEVICE_DMA_READ: {
-        assert((dst_addr + dma_len) < PCIE_TEST_DEVICE_BUFF_SIZE_BYTES);
-        DEBUG_PRINT("%s - Performing DMA host -> device\n", __func__);
+    DEBUG_PRINT("%s - Performing DMA %s\n", __func__, isToDevice ? "host -> device" : "device -> host");
 
-        dmaResult = pci_dma_read(pci_dev, src_addr, (void *)&pRam[dst_addr], dma_len);
-        if (dmaResult != MEMTX_OK) {
-            DEBUG_PRINT("%s - Transfer failed with status %" PRIu32 "\n", __func__, dmaResult);
+    MemTxResult dmaResult;
+    if (descCtrl.bits.sgl) {
+        dmaResult = pcie_test_device_dma_sgl(dev, isToDevice, host_addr, desc->sglEntries, dev_addr, dma_len);
+    } else {
+        dmaResult = pcie_test_device_dma_host(dev, isToDevice, host_addr, dev_addr, dma_len);
+    }
+
+    if (dmaResult != MEMTX_OK) {
+        DEBUG_PRINT("%s - Transfer failed with status %" PRIu32 "\n", __func__, dmaResult);
+        return dmaResult;
+    }
+
+    // The device side holds the moved bytes contiguously in either direction
+    if (descCtrl.bits.type == TEST_DEVICE_DMA_READ_CRC32C || descCtrl.bits.type == TEST_DEVICE_DMA_WRITE_CRC32C) {
+        const uint8_t *pRam = memory_region_get_ram_ptr(dev->memRegion);
+        *result = pcie_test_device_crc32c(&pRam[dev_addr], dma_len);
+    }
+    return dmaResult;
+}
+
+// Account a consumed descriptor and the time it kept its queue busy
+static void pcie_test_device_count_desc(PcieTestDevice *dev, const DmaDescriptor_t *desc, const MemTxResult dmaResult,
+                                        const int64_t busyNs)
+{
+    DmaDescCtrl_t descCtrl = { .all = desc->ctrl };
+
+    stat64_add(&dev->counters[TEST_DEVICE_CNT_DESC_DONE], 1);
+    stat64_add(&dev->counters[TEST_DEVICE_CNT_BUSY_NS], busyNs);
+    if (dmaResult != MEMTX_OK) {
+        stat64_add(&dev->counters[TEST_DEVICE_CNT_DMA_ERRORS], 1);
+        return;
+    }
+    if (!PCIE_TEST_DEVICE_DMA_IS_HOST(descCtrl.bits.type)) {
+        return;
+    }
+
+    const bool isToDevice = PCIE_TEST_DEVICE_DMA_IS_TO_DEVICE(descCtrl.bits.type);
+    stat64_add(&dev->counters[isToDevice ? TEST_DEVICE_CNT_BYTES_TO_DEVICE : TEST_DEVICE_CNT_BYTES_TO_HOST],
+               desc->txSize);
+}
+
+// The queues stop taking new descriptors when the device goes away or the VM stops
+static bool pcie_test_device_dma_halted(PcieTestDevice *dev)
+{
+    return qatomic_read(&dev->dmaStopping) || qatomic_read(&dev->dmaPaused);
+}
+
+static uint32_t pcie_test_device_ring_size(PcieTestDeviceQueue *queue)
+{
+    DeviceRingCtrl_t ringCtrl = { .all = RING_REG(queue->dev->regs, queue->id, PCIE_TEST_DEVICE_RING_CTRL) };
+    if (!ringCtrl.bits.host_mem) {
+        return PCIE_TEST_DEVICE_QUEUE_NUM_DESC;
+    }
+
+    const uint32_t size = RING_REG(queue->dev->regs, queue->id, PCIE_TEST_DEVICE_RING_SIZE);
+    return (size <= PCIE_TEST_DEVICE_RING_MAX_SIZE) ? size : 0;
+}
+
+// Fetch `count` descriptors starting at ring slot `idx`, the caller guarantees the range does not wrap.
+// Called with the queue lock held, the lock is dropped while reading from host memory.
+static MemTxResult pcie_test_device_fetch_desc(PcieTestDeviceQueue *queue, const uint32_t idx, DmaDescriptor_t *desc,
+                                               const uint32_t count)
+{
+    PcieTestDevice *dev = queue->dev;
+    DeviceRingCtrl_t ringCtrl = { .all = RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_CTRL) };
+    if (!ringCtrl.bits.host_mem) {
+        // BAR0 descriptors share the host memory layout
+        const uint32_t slot = (queue->id * PCIE_TEST_DEVICE_QUEUE_NUM_DESC) + idx;
+        memcpy(desc, &DMA_REG(dev->regs, slot, 0), count * sizeof(DmaDescriptor_t));
+        return MEMTX_OK;
+    }
+
+    dma_addr_t ring_addr = ((dma_addr_t)RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_ADDR_HI) << 32)
+                           | ((dma_addr_t)RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_ADDR_LOW));
+    qemu_mutex_unlock(&queue->lock);
+    MemTxResult dmaResult = pcie_test_device_dma_rw(dev, ring_addr + ((dma_addr_t)idx * sizeof(DmaDescriptor_t)),
+                                                    desc, count * sizeof(DmaDescriptor_t), DMA_DIRECTION_TO_DEVICE);
+    qemu_mutex_lock(&queue->lock);
+    if (dmaResult != MEMTX_OK) {
+        DEBUG_PRINT("%s - Descriptor fetch failed with status %" PRIu32 "\n", __func__, dmaResult);
+        return dmaResult;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        le32_to_cpus(&desc[i].srcAddrHi);
+        le32_to_cpus(&desc[i].srcAddrLow);
+        le32_to_cpus(&desc[i].dstAddrHi);
+        le32_to_cpus(&desc[i].dstAddrLow);
+        le32_to_cpus(&desc[i].txSize);
+        le32_to_cpus(&desc[i].ctrl);
+        le32_to_cpus(&desc[i].sglEntries);
+    }
+    return MEMTX_OK;
+}
+
+// Effective data rate of a single lane in Mbit/s after line encoding
+static uint64_t pcie_test_device_lane_rate_mbps(const PCIExpLinkSpeed speed)
+{
+    switch (speed) {
+    case QEMU_PCI_EXP_LNK_2_5GT:
+        return 2000; // 8b/10b
+    case QEMU_PCI_EXP_LNK_5GT:
+        return 4000; // 8b/10b
+    case QEMU_PCI_EXP_LNK_8GT:
+        return 7877; // 128b/130b
+    case QEMU_PCI_EXP_LNK_16GT:
+        return 15754;
+    case QEMU_PCI_EXP_LNK_32GT:
+        return 31508;
+    case QEMU_PCI_EXP_LNK_64GT:
+        return 63015;
+    default:
+        return 2000;
+    }
+}
+
+// Time the configured link needs to move `len` bytes of payload
+static int64_t pcie_test_device_link_time_ns(PcieTestDevice *dev, const uint64_t len)
+{
+    const uint64_t maxPayload = MAX(dev->linkMaxPayload, 1);
+    const uint64_t numTlp = DIV_ROUND_UP(len, maxPayload);
+    const uint64_t wireBytes = len + (numTlp * PCIE_TEST_DEVICE_TLP_OVERHEAD_BYTES);
+    const uint64_t linkRateMbps = pcie_test_device_lane_rate_mbps(dev->speed) * MAX((uint32_t)dev->width, 1);
+
+    return dev->linkLatencyNs + muldiv64(wireBytes, 8000, linkRateMbps);
+}
+
+// Hold the completion of `len` bytes until the link would have transferred them.
+// Transfers of all queues are serialized on the link.
+static void pcie_test_device_link_delay(PcieTestDevice *dev, const uint64_t len)
+{
+    QEMU_LOCK_GUARD(&dev->linkLock);
+
+    const int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    const int64_t deadline = MAX(now, dev->linkBusyUntil) + pcie_test_device_link_time_ns(dev, len);
+    dev->linkBusyUntil = deadline;
+
+    // The timer may already be armed for an earlier deadline of another queue, re-arm after every wakeup
+    // The virtual clock does not advance while the VM is stopped
+    while (!pcie_test_device_dma_halted(dev) && qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) < deadline) {
+        timer_mod_anticipate(dev->linkTimer, deadline);
+        qemu_cond_wait(&dev->linkCond, &dev->linkLock);
+    }
+}
+
+static void pcie_test_device_link_timer(void *opaque)
+{
+    PcieTestDevice *d = opaque;
+
+    QEMU_LOCK_GUARD(&d->linkLock);
+    qemu_cond_broadcast(&d->linkCond);
+}
+
+static bool pcie_test_device_cq_full(PcieTestDeviceQueue *queue, const uint32_t size)
+{
+    // One entry stays free so a full queue can be told apart from an empty one
+    return PCIE_TEST_DEVICE_RING_NEXT(queue->cqTail, size)
+           == RING_REG(queue->dev->regs, queue->id, PCIE_TEST_DEVICE_RING_CQ_HEAD);
+}
+
+// Wait for a free completion entry before a descriptor runs, so a halt never catches a moved descriptor without
+// its completion. Called with the queue lock held, returns false when the DMA engine halted instead.
+static bool pcie_test_device_cq_reserve(PcieTestDeviceQueue *queue)
+{
+    const uint32_t size = pcie_test_device_cq_size(queue);
+
+    while (!pcie_test_device_dma_halted(queue->dev) && size != 0 && pcie_test_device_cq_full(queue, size)) {
+        qemu_cond_wait(&queue->cond, &queue->lock);
+    }
+    return !pcie_test_device_dma_halted(queue->dev);
+}
+
+// Write the completion entry of ring slot `descId` to the completion queue reserved by
+// pcie_test_device_cq_reserve(). Called with the queue lock held, the lock is dropped while writing to host memory.
+static void pcie_test_device_post_cpl(PcieTestDeviceQueue *queue, const uint32_t descId, const DmaDescriptor_t *desc,
+                                      const MemTxResult dmaResult, const uint64_t result)
+{
+    PcieTestDevice *dev = queue->dev;
+    const uint32_t size = pcie_test_device_cq_size(queue);
+    if (size == 0) {
+        return;
+    }
+
+    // The host re-initialized the ring while the descriptor ran
+    if (pcie_test_device_cq_full(queue, size)) {
+        DEBUG_PRINT("%s - Completion queue %" PRIu32 " full, dropping completion!\n", __func__, queue->id);
+        return;
+    }
+
+    DmaDescCtrl_t descCtrl = { .all = desc->ctrl };
+    DmaCplStatus_t status = { 0 };
+    status.bits.phase = queue->cqPhase;
+    status.bits.error = (dmaResult != MEMTX_OK);
+    status.bits.mismatch = (!status.bits.error && descCtrl.bits.type == TEST_DEVICE_DMA_COMPARE
+                            && result < desc->txSize);
+
+    DmaCplEntry_t entry = { 0 };
+    entry.descId = cpu_to_le32(descId);
+    entry.bytes = cpu_to_le32(status.bits.error ? 0 : desc->txSize);
+    entry.timestamp = cpu_to_le64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    entry.result = cpu_to_le64(result);
+    entry.status = cpu_to_le32(status.all);
+
+    const dma_addr_t cqAddr = ((dma_addr_t)RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_CQ_ADDR_HI) << 32)
+                              | ((dma_addr_t)RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_CQ_ADDR_LOW));
+    const dma_addr_t entryAddr = cqAddr + ((dma_addr_t)queue->cqTail * sizeof(DmaCplEntry_t));
+
+    queue->cqTail = PCIE_TEST_DEVICE_RING_NEXT(queue->cqTail, size);
+    if (queue->cqTail == 0) {
+        queue->cqPhase = !queue->cqPhase;
+    }
+
+    // The host polls on the phase in the status word, it has to become visible last
+    qemu_mutex_unlock(&queue->lock);
+    MemTxResult cplResult =
+        pcie_test_device_dma_rw(dev, entryAddr, &entry, offsetof(DmaCplEntry_t, status), DMA_DIRECTION_FROM_DEVICE);
+    smp_wmb();
+    cplResult |= pcie_test_device_dma_rw(dev, entryAddr + offsetof(DmaCplEntry_t, status), &entry.status,
+                                         sizeof(entry.status), DMA_DIRECTION_FROM_DEVICE);
+    qemu_mutex_lock(&queue->lock);
+    if (cplResult != MEMTX_OK) {
+        DEBUG_PRINT("%s - Completion write failed with status %" PRIu32 "\n", __func__, cplResult);
+    }
+}
+
+// Raise the queue interrupt for all pending completions. Called with the queue lock held.
+static void pcie_test_device_queue_signal(PcieTestDeviceQueue *queue)
+{
+    PcieTestDevice *dev = queue->dev;
+
+    queue->coalPending = 0;
+    timer_del(queue->coalTimer);
+    qatomic_or(&dev->pendingIrq, PCIE_TEST_DEVICE_INT_BIT(queue->id));
+    qemu_bh_schedule(dev->completionBh);
+}
+
+// Account one completion and signal it once a coalescing threshold is reached.
+// Called with the queue lock held.
+static void pcie_test_device_queue_complete(PcieTestDeviceQueue *queue)
+{
+    PcieTestDevice *dev = queue->dev;
+    const uint32_t maxCount = RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_COAL_COUNT);
+    const uint32_t maxUsec = RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_COAL_USEC);
+
+    queue->coalPending++;
+    if (maxCount != 0 && queue->coalPending >= maxCount) {
+        pcie_test_device_queue_signal(queue);
+        return;
+    }
+
+    // The delay is bounded from the first completion, later ones do not push the interrupt out
+    if (maxUsec != 0 && queue->coalPending == 1) {
+        timer_mod(queue->coalTimer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ((int64_t)maxUsec * SCALE_US));
+    }
+}
+
+static void pcie_test_device_coal_timer(void *opaque)
+{
+    PcieTestDeviceQueue *queue = opaque;
+
+    QEMU_LOCK_GUARD(&queue->lock);
+    if (queue->coalPending != 0) {
+        pcie_test_device_queue_signal(queue);
+    }
+}
+
+// Called with the queue lock held, the lock is dropped while data is moved
+static void pcie_test_device_process_ring(PcieTestDeviceQueue *queue)
+{
+    PcieTestDevice *dev = queue->dev;
+    DmaDescriptor_t desc[PCIE_TEST_DEVICE_DESC_FETCH_BATCH];
+    const uint32_t size = pcie_test_device_ring_size(queue);
+    uint32_t head = RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_HEAD);
+
+    // Drain every posted descriptor including ones posted while we are running,
+    // a failed descriptor is still consumed
+    while (!pcie_test_device_dma_halted(dev) && size != 0
+           && head != RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_TAIL)) {
+        const uint32_t tail = RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_TAIL);
+        const uint32_t contiguous = (tail > head) ? (tail - head) : (size - head);
+        const uint32_t count = MIN(contiguous, PCIE_TEST_DEVICE_DESC_FETCH_BATCH);
+        const uint32_t ringGen = queue->ringGen;
+
+        if (pcie_test_device_fetch_desc(queue, head, desc, count) != MEMTX_OK) {
+            // Leave the ring where it is, the host has to re-initialize it
+            break;
         }
-    } break;
-    case TEST_DEVICE_DMA_WRITE: {
-        assert((src_addr + dma_len) < PCIE_TEST_DEVICE_BUFF_SIZE_BYTES);
-        DEBUG_PRINT("%s - Performing DMA device -> host\n", __func__);
 
-        dmaResult = pci_dma_write(pci_dev, dst_addr, (void *)&pRam[src_addr], dma_len);
-        if (dmaResult != MEMTX_OK) {
-            DEBUG_PRINT("%s - Transfer failed with status %" PRIu32 "\n", __func__, dmaResult);
+        for (uint32_t i = 0; i < count; i++) {
+            // Descriptors not started yet are fetched again once the engine resumes
+            if (!pcie_test_device_cq_reserve(queue)) {
+                break;
+            }
+            // The host re-initialized the ring, what was fetched before is gone
+            if (queue->ringGen != ringGen) {
+                head = RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_HEAD);
+                break;
+            }
+            qemu_mutex_unlock(&queue->lock);
+            const int64_t start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            uint64_t result;
+            const MemTxResult dmaResult = pcie_test_device_run_desc(dev, &desc[i], &result);
+            DmaDescCtrl_t descCtrl = { .all = desc[i].ctrl };
+            if (dev->linkModel && PCIE_TEST_DEVICE_DMA_IS_HOST(descCtrl.bits.type)) {
+                pcie_test_device_link_delay(dev, desc[i].txSize);
+            }
+            pcie_test_device_count_desc(dev, &desc[i], dmaResult, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - start);
+            qemu_mutex_lock(&queue->lock);
+
+            // Likewise the completion of a descriptor that ran while the ring was re-initialized
+            if (queue->ringGen != ringGen) {
+                head = RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_HEAD);
+                break;
+            }
+
+            const uint32_t descId = head;
+            head = PCIE_TEST_DEVICE_RING_NEXT(head, size);
+            RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_HEAD) = head;
+            pcie_test_device_post_cpl(queue, descId, &desc[i], dmaResult, result);
+            pcie_test_device_queue_complete(queue);
         }
-    } break;
-    default:
-        break;
     }
 
-    // Signal completion and update registers
-    DEBUG_PRINT("%s - Update completion registers\n", __func__);
-    deviceStatus.bits.busy_0 = 0;
-    CTRL_REGS(dev->regs, PCIE_TEST_DEVICE_MMIO_STATUS_OFFSET) = deviceStatus.all;
+    // A paused queue stays busy and picks up at RING_HEAD when the VM runs again
+    if (!qatomic_read(&dev->dmaPaused)) {
+        DEBUG_PRINT("%s - Queue %" PRIu32 " drained\n", __func__, queue->id);
+        qatomic_set(&queue->busy, false);
+    }
 
-    // Early exit since DMA failed
-    if (dmaResult != MEMTX_OK) {
+    // Without a coalescing delay the rest is signalled once the ring is drained
+    if (queue->coalPending != 0 && RING_REG(dev->regs, queue->id, PCIE_TEST_DEVICE_RING_COAL_USEC) == 0) {
+        pcie_test_device_queue_signal(queue);
+    }
+}
+
+static void *pcie_test_device_dma_thread(void *opaque)
+{
+    PcieTestDeviceQueue *queue = opaque;
+
+    // DMA looks up the guest memory map under RCU
+    rcu_register_thread();
+
+    qemu_mutex_lock(&queue->lock);
+    while (!qatomic_read(&queue->dev->dmaStopping)) {
+        if (!queue->busy || qatomic_read(&queue->dev->dmaPaused)) {
+            qemu_cond_wait(&queue->cond, &queue->lock);
+            continue;
+        }
+        queue->active = true;
+        pcie_test_device_process_ring(queue);
+        queue->active = false;
+        qemu_cond_broadcast(&queue->idleCond);
+    }
+    qemu_mutex_unlock(&queue->lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void pcie_test_device_completion_bh(void *opaque)
+{
+    PcieTestDevice *d = opaque;
+
+    DEBUG_PRINT("%s - Signal DMA completion\n", __func__);
+    pcie_test_device_raise_interrupts(d, qatomic_xchg(&d->pendingIrq, 0));
+}
+
+// Move the queue TAIL to `tail` and wake its DMA thread. Called with the queue lock held.
+static void pcie_test_device_ring_doorbell(PcieTestDeviceQueue *queue, const uint32_t tail)
+{
+    PcieTestDevice *d = queue->dev;
+
+    if (tail >= pcie_test_device_ring_size(queue)) {
+        DEBUG_PRINT("%s - Invalid ring tail %" PRIu32 " on queue %" PRIu32 "!\n", __func__, tail, queue->id);
+        return;
+    }
+    RING_REG(d->regs, queue->id, PCIE_TEST_DEVICE_RING_TAIL) = tail;
+
+    // Queue is busy from the doorbell until its DMA thread drained the ring
+    if (tail != RING_REG(d->regs, queue->id, PCIE_TEST_DEVICE_RING_HEAD)) {
+        qatomic_set(&queue->busy, true);
+        qemu_cond_signal(&queue->cond);
+    }
+}
+
+// Read the shadow TAIL from guest RAM. A shadow anywhere else is refused, dispatching the read to MMIO could come
+// back to the registers of this queue while its lock is held.
+static bool pcie_test_device_read_shadow(PcieTestDevice *d, const dma_addr_t shadowAddr, uint32_t *tail)
+{
+    uint32_t value;
+
+    if (pcie_test_device_dma_rw(d, shadowAddr, &value, sizeof(value), DMA_DIRECTION_TO_DEVICE) != MEMTX_OK) {
+        return false;
+    }
+    *tail = le32_to_cpu(value);
+    return true;
+}
+
+// Ring the doorbell with the TAIL the host stored in the shadow. Called with the queue lock held, which keeps
+// concurrent kicks from applying an older shadow value after a newer one.
+static void pcie_test_device_ring_kick(PcieTestDeviceQueue *queue)
+{
+    PcieTestDevice *d = queue->dev;
+    uint32_t tail;
+
+    const dma_addr_t shadowAddr = ((dma_addr_t)RING_REG(d->regs, queue->id, PCIE_TEST_DEVICE_RING_SHADOW_HI) << 32)
+                                  | ((dma_addr_t)RING_REG(d->regs, queue->id, PCIE_TEST_DEVICE_RING_SHADOW_LOW));
+    if (shadowAddr == 0) {
+        DEBUG_PRINT("%s - Kick without shadow tail on queue %" PRIu32 "!\n", __func__, queue->id);
+        return;
+    }
+    if (!pcie_test_device_read_shadow(d, shadowAddr, &tail)) {
+        DEBUG_PRINT("%s - Shadow tail read failed on queue %" PRIu32 "!\n", __func__, queue->id);
         return;
     }
+    pcie_test_device_ring_doorbell(queue, tail);
+}
+
+// Kicks that arrive while one is handled only set the eventfd again, they are merged into one shadow read
+static void pcie_test_device_kick_notify(EventNotifier *notifier)
+{
+    PcieTestDeviceQueue *queue = container_of(notifier, PcieTestDeviceQueue, kick);
+
+    if (event_notifier_test_and_clear(notifier)) {
+        QEMU_LOCK_GUARD(&queue->lock);
+        pcie_test_device_ring_kick(queue);
+    }
+}
 
-    // Update interrupt status
-    DeviceIntStatus_t intStatus = { .all = CTRL_REGS(dev->regs, PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET) };
-    intStatus.bits.int_0 = 1;
-    CTRL_REGS(dev->regs, PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET) = intStatus.all;
+static AioContext *pcie_test_device_kick_context(PcieTestDevice *d)
+{
+    return (d->iothread != NULL) ? iothread_get_aio_context(d->iothread) : qemu_get_aio_context();
+}
 
-    pcie_test_device_assert_interrupt(dev);
+static bool mmio_address_is_counter(hwaddr addr)
+{
+    return addr >= PCIE_TEST_DEVICE_CNT_BASE_OFFSET && addr < PCIE_TEST_DEVICE_CNT_OFFSET(TEST_DEVICE_NUM_COUNTERS);
 }
 
 static bool mmio_address_in_range(hwaddr addr)
 {
-    bool inCtrlRange = (addr <= PCIE_TEST_DEVICE_MMIO_LAST_ADDR);
+    bool inCtrlRange = (addr <= PCIE_TEST_DEVICE_MMIO_LAST_ADDR) || mmio_address_is_counter(addr);
+    bool inRingRange = (addr >= PCIE_TEST_DEVICE_RING_BASE_OFFSET
+                        && addr < PCIE_TEST_DEVICE_RING_OFFSET(PCIE_TEST_DEVICE_NUM_QUEUES)
+                        && ((addr - PCIE_TEST_DEVICE_RING_BASE_OFFSET) % PCIE_TEST_DEVICE_RING_STRIDE)
+                               <= PCIE_TEST_DEVICE_RING_LAST_ADDR);
+
+    bool inDescRange = (addr >= PCIE_TEST_DEVICE_DESC_BASE_OFFSET
+                        && addr < PCIE_TEST_DEVICE_DESC_OFFSET(PCIE_TEST_DEVICE_NUM_DESC)
+                        && ((addr - PCIE_TEST_DEVICE_DESC_BASE_OFFSET) % PCIE_TEST_DEVICE_DESC_SIZE)
+                               <= PCIE_TEST_DEVICE_DESC_LAST_ADDR);
+
+    bool inDoorbellRange = false;
+    if (addr >= PCIE_TEST_DEVICE_DOORBELL_BASE_OFFSET
+        && addr < PCIE_TEST_DEVICE_DOORBELL_OFFSET(PCIE_TEST_DEVICE_NUM_QUEUES)) {
+        const hwaddr reg = (addr - PCIE_TEST_DEVICE_DOORBELL_BASE_OFFSET) % PCIE_TEST_DEVICE_DOORBELL_STRIDE;
+        inDoorbellRange = (reg == PCIE_TEST_DEVICE_RING_HEAD || reg == PCIE_TEST_DEVICE_RING_TAIL
+                           || reg == PCIE_TEST_DEVICE_RING_CQ_HEAD || reg == PCIE_TEST_DEVICE_RING_KICK);
+    }
+    return inCtrlRange | inRingRange | inDescRange | inDoorbellRange;
+}
 
-    bool inDescRange = false;
-    for (uint8_t idx = 0; idx < PCIE_TEST_DEVICE_NUM_DESC; idx++) {
-        inDescRange |= (addr >= PCIE_TEST_DEVICE_DESC_OFFSET(idx)
-                        && addr <= (PCIE_TEST_DEVICE_DESC_OFFSET(idx) + PCIE_TEST_DEVICE_DESC_LAST_ADDR));
+// Doorbell page registers alias the ring registers of their queue
+static hwaddr mmio_doorbell_alias(hwaddr addr)
+{
+    if (addr < PCIE_TEST_DEVICE_DOORBELL_BASE_OFFSET) {
+        return addr;
+    }
+
+    const uint32_t q = (addr - PCIE_TEST_DEVICE_DOORBELL_BASE_OFFSET) / PCIE_TEST_DEVICE_DOORBELL_STRIDE;
+    return PCIE_TEST_DEVICE_RING_OFFSET(q) + (addr - PCIE_TEST_DEVICE_DOORBELL_OFFSET(q));
+}
+
+// Queue owning a ring register or BAR0 descriptor slot, NULL for the shared control registers
+static PcieTestDeviceQueue *mmio_address_queue(PcieTestDevice *d, hwaddr addr)
+{
+    if (addr >= PCIE_TEST_DEVICE_DESC_BASE_OFFSET) {
+        const uint32_t slot = (addr - PCIE_TEST_DEVICE_DESC_BASE_OFFSET) / PCIE_TEST_DEVICE_DESC_SIZE;
+        return &d->queues[slot / PCIE_TEST_DEVICE_QUEUE_NUM_DESC];
+    }
+    if (addr >= PCIE_TEST_DEVICE_RING_BASE_OFFSET) {
+        return &d->queues[(addr - PCIE_TEST_DEVICE_RING_BASE_OFFSET) / PCIE_TEST_DEVICE_RING_STRIDE];
+    }
+    return NULL;
+}
+
+static void mmio_queue_write(PcieTestDeviceQueue *queue, hwaddr addr, uint64_t value)
+{
+    PcieTestDevice *d = queue->dev;
+
+    QEMU_LOCK_GUARD(&queue->lock);
+
+    // BAR0 descriptor slot
+    if (addr >= PCIE_TEST_DEVICE_DESC_BASE_OFFSET) {
+        CTRL_REGS(d->regs, addr) = value;
+        return;
+    }
+
+    switch (addr - PCIE_TEST_DEVICE_RING_OFFSET(queue->id)) {
+    case PCIE_TEST_DEVICE_RING_TAIL: {
+        pcie_test_device_ring_doorbell(queue, value);
+    } break;
+    case PCIE_TEST_DEVICE_RING_KICK: {
+        // Reaches here when the write was not taken by the ioeventfd
+        pcie_test_device_ring_kick(queue);
+    } break;
+    case PCIE_TEST_DEVICE_RING_CTRL: {
+        DEBUG_PRINT("%s - Re-initialize descriptor ring of queue %" PRIu32 "\n", __func__, queue->id);
+        CTRL_REGS(d->regs, addr) = value;
+        RING_REG(d->regs, queue->id, PCIE_TEST_DEVICE_RING_HEAD) = 0;
+        RING_REG(d->regs, queue->id, PCIE_TEST_DEVICE_RING_TAIL) = 0;
+        RING_REG(d->regs, queue->id, PCIE_TEST_DEVICE_RING_CQ_HEAD) = 0;
+        queue->cqTail = 0;
+        queue->cqPhase = true;
+
+        // The DMA thread drops what it fetched, also when it waits for a completion entry
+        queue->ringGen++;
+        qemu_cond_signal(&queue->cond);
+    } break;
+    case PCIE_TEST_DEVICE_RING_CQ_HEAD: {
+        if (value >= MAX(pcie_test_device_cq_size(queue), 1)) {
+            DEBUG_PRINT("%s - Invalid completion queue head %" PRIu64 " on queue %" PRIu32 "!\n", __func__, value,
+                        queue->id);
+            return;
+        }
+        CTRL_REGS(d->regs, addr) = value;
+
+        // Resume a queue stalled on a full completion queue
+        qemu_cond_signal(&queue->cond);
+    } break;
+    case PCIE_TEST_DEVICE_RING_HEAD: {
+        // Do nothing since this should be RO
+    } break;
+    default: {
+        CTRL_REGS(d->regs, addr) = value;
+    } break;
     }
-    return inCtrlRange | inDescRange;
 }
 
 static void mmio_write(void *opaque, hwaddr addr, uint64_t value, unsigned size)
@@ -186,15 +1012,26 @@ static void mmio_write(void *opaque, hwaddr addr, uint64_t value, unsigned size)
         DEBUG_PRINT("%s - Invalid register address!\n", __func__);
         return;
     }
+    addr = mmio_doorbell_alias(addr);
+
+    // Queues only contend on their own registers
+    PcieTestDeviceQueue *queue = mmio_address_queue(d, addr);
+    if (queue != NULL) {
+        mmio_queue_write(queue, addr, value);
+        return;
+    }
+
+    // Counters are RO
+    if (mmio_address_is_counter(addr)) {
+        return;
+    }
 
+    // The control registers are only accessed under the BQL
     switch (addr) {
     case PCIE_TEST_DEVICE_MMIO_CTRL_OFFSET: {
         DeviceCtrl_t ctrl = { .all = value };
-        CTRL_REGS(d->regs, addr) = ctrl.all;
-        pcie_test_device_start_transfer(d, 0, ctrl.bits.start & ~ctrl.bits.reset);
 
-        // Always clear start, reset bit
-        ctrl.bits.start = 0;
+        // Always clear reset bit
         ctrl.bits.reset = 0;
         CTRL_REGS(d->regs, addr) = ctrl.all;
     } break;
@@ -203,20 +1040,35 @@ static void mmio_write(void *opaque, hwaddr addr, uint64_t value, unsigned size)
         // Clear interrupt on write
         CTRL_REGS(d->regs, addr) = CTRL_REGS(d->regs, addr) & ~value;
 
+        // The legacy line is shared by all vectors, keep it up while any unmasked bit is pending
         bool isMsixEnabled = msix_enabled(PCI_DEVICE(pci_dev));
-        if (!isMsixEnabled) {
+        const uint32_t pending =
+            CTRL_REGS(d->regs, addr) & CTRL_REGS(d->regs, PCIE_TEST_DEVICE_MMIO_INT_MASK_OFFSET);
+        if (!isMsixEnabled && pending == 0) {
             pci_irq_deassert(pci_dev);
         }
     } break;
+    case PCIE_TEST_DEVICE_MMIO_INT_MASK_OFFSET: {
+        const uint32_t unmasked = value & ~CTRL_REGS(d->regs, addr);
+        CTRL_REGS(d->regs, addr) = value;
+
+        // Fire whatever was raised while masked, queues that are not latched drop their pending bit
+        const uint32_t pending = unmasked & CTRL_REGS(d->regs, PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET);
+        for (uint32_t vector = 0; vector < PCIE_TEST_DEVICE_NUM_VECTORS; vector++) {
+            if (!(pending & PCIE_TEST_DEVICE_INT_BIT(vector))) {
+                continue;
+            }
+            if (!pcie_test_device_is_latched(d, vector)) {
+                CTRL_REGS(d->regs, PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET) &= ~PCIE_TEST_DEVICE_INT_BIT(vector);
+            }
+            pcie_test_device_assert_interrupt(d, vector);
+        }
+    } break;
     case PCIE_TEST_DEVICE_MMIO_INT_TRIGGER_OFFSET: {
         DEBUG_PRINT("%s - Trigger interrupt status and assert IRQ\n", __func__);
 
-        DeviceIntStatus_t intStatus = { .all = CTRL_REGS(d->regs, PCIE_TEST_DEVICE_MMIO_INT_MASK_OFFSET) };
-        intStatus.bits.int_0 = 1;
-        CTRL_REGS(d->regs, PCIE_TEST_DEVICE_MMIO_INT_STATUS_OFFSET) = intStatus.all;
-
-        // Check if interrupt mask is enabled
-        pcie_test_device_assert_interrupt(d);
+        // Each set bit fires its vector
+        pcie_test_device_raise_interrupts(d, value);
     } break;
     case PCIE_TEST_DEVICE_MMIO_STATUS_OFFSET:
     case PCIE_TEST_DEVICE_MMIO_VER_OFFSET: {
@@ -236,8 +1088,33 @@ static uint64_t mmio_read(void *opaque, hwaddr addr, unsigned size)
         DEBUG_PRINT("%s - Invalid register address!\n", __func__);
         return UINT64_MAX;
     }
+    addr = mmio_doorbell_alias(addr);
 
     PcieTestDevice *d = PCIE_TEST_DEVICE(opaque);
+    if (addr == PCIE_TEST_DEVICE_MMIO_STATUS_OFFSET) {
+        // Busy bit per queue
+        uint32_t status = 0;
+        for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+            status |= qatomic_read(&d->queues[q].busy) ? (1u << q) : 0;
+        }
+        return status;
+    }
+
+    // A LOW read snapshots the counter for the following HI read
+    if (mmio_address_is_counter(addr)) {
+        const uint32_t counter = (addr - PCIE_TEST_DEVICE_CNT_BASE_OFFSET) / PCIE_TEST_DEVICE_CNT_STRIDE;
+        if (addr == PCIE_TEST_DEVICE_CNT_OFFSET(counter) + PCIE_TEST_DEVICE_CNT_LOW) {
+            d->counterSnapshot[counter] = stat64_get(&d->counters[counter]);
+            return (uint32_t)d->counterSnapshot[counter];
+        }
+        return d->counterSnapshot[counter] >> 32;
+    }
+
+    PcieTestDeviceQueue *queue = mmio_address_queue(d, addr);
+    if (queue != NULL) {
+        QEMU_LOCK_GUARD(&queue->lock);
+        return CTRL_REGS(d->regs, addr);
+    }
     return CTRL_REGS(d->regs, addr);
 }
 
@@ -257,34 +1134,173 @@ static const MemoryRegionOps bar_ops = {
         },
 };
 
+// Write the incrementing pattern to `len` bytes of BAR1 from `offset`, a multiple of the pattern length.
+static void pcie_test_device_scrub(PcieTestDevice *d, const uint64_t offset, const uint64_t len)
+{
+    uint8_t *pRam = (uint8_t *)memory_region_get_ram_ptr(d->memRegion) + offset;
+    const uint64_t patternLen = MIN(len, PCIE_TEST_DEVICE_SCRUB_PATTERN_BYTES);
+
+    for (uint64_t idx = 0; idx < patternLen; idx++) {
+        pRam[idx] = (idx & UINT8_MAX);
+    }
+    pcie_test_device_repeat(pRam, patternLen, len);
+    memory_region_set_dirty(d->memRegion, offset, len);
+}
+
+// Scrub the BAR1 pages written since the last scrub, by the guest or by DMA
+static void pcie_test_device_rescrub(PcieTestDevice *d)
+{
+    const uint64_t pageSize = qemu_target_page_size();
+
+    DirtyBitmapSnapshot *snap = memory_region_snapshot_and_clear_dirty(d->memRegion, 0, d->memSize, DIRTY_MEMORY_VGA);
+    for (uint64_t offset = 0; offset < d->memSize; offset += pageSize) {
+        if (memory_region_snapshot_get_dirty(d->memRegion, snap, offset, pageSize)) {
+            pcie_test_device_scrub(d, offset, pageSize);
+        }
+    }
+    g_free(snap);
+
+    // The scrub itself marked the pages dirty again
+    memory_region_reset_dirty(d->memRegion, 0, d->memSize, DIRTY_MEMORY_VGA);
+}
+
 static void pcie_test_device_reset_regs_and_mem(DeviceState *qdev, const bool isScrubRam)
 {
     PcieTestDevice *d = PCIE_TEST_DEVICE(qdev);
 
-    DEBUG_PRINT("%s - Clearing control registers\n", __func__);
-    for (uint8_t idx = 0; idx <= PCIE_TEST_DEVICE_MMIO_LAST_ADDR; idx += sizeof(uint32_t)) {
-        CTRL_REGS(d->regs, idx) = 0;
-    }
+    DEBUG_PRINT("%s - Clearing registers\n", __func__);
+    // Control, ring and descriptor registers
+    memset(d->regs, 0, sizeof(d->regs));
     CTRL_REGS(d->regs, PCIE_TEST_DEVICE_MMIO_VER_OFFSET) = PCI_TEST_DEVICE_IP_VERSION;
 
-    for (uint8_t idx = 0; idx < PCIE_TEST_DEVICE_NUM_DESC; idx++) {
-        DMA_REG(d->regs, idx, PCIE_TEST_DEVICE_DESC_SRC_ADDR_HI) = 0;
-        DMA_REG(d->regs, idx, PCIE_TEST_DEVICE_DESC_SRC_ADDR_LOW) = 0;
-        DMA_REG(d->regs, idx, PCIE_TEST_DEVICE_DESC_DST_ADDR_HI) = 0;
-        DMA_REG(d->regs, idx, PCIE_TEST_DEVICE_DESC_DST_ADDR_LOW) = 0;
-        DMA_REG(d->regs, idx, PCIE_TEST_DEVICE_DESC_TX_SIZE) = 0;
+    for (uint32_t counter = 0; counter < TEST_DEVICE_NUM_COUNTERS; counter++) {
+        stat64_init(&d->counters[counter], 0);
+        d->counterSnapshot[counter] = 0;
     }
 
     if (isScrubRam) {
         DEBUG_PRINT("%s - Scrub device RAM with incrementing pattern\n", __func__);
+        pcie_test_device_scrub(d, 0, d->memSize);
+    }
+}
 
-        volatile uint8_t *pRam = memory_region_get_ram_ptr(&d->mem);
-        for (uint32_t idx = 0; idx < PCIE_TEST_DEVICE_BUFF_SIZE_BYTES; idx++) {
-            pRam[idx] = (idx & UINT8_MAX);
+// Quiesce the DMA engine, queues finish the descriptor they are running and the rest stays posted in the ring.
+// Waiting under the BQL is fine, the DMA threads only access RAM and never take it.
+static void pcie_test_device_dma_pause(PcieTestDevice *d)
+{
+    qatomic_set(&d->dmaPaused, true);
+    qemu_mutex_lock(&d->linkLock);
+    qemu_cond_broadcast(&d->linkCond);
+    qemu_mutex_unlock(&d->linkLock);
+
+    for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+        PcieTestDeviceQueue *queue = &d->queues[q];
+
+        QEMU_LOCK_GUARD(&queue->lock);
+        qemu_cond_signal(&queue->cond);
+        while (queue->active) {
+            qemu_cond_wait(&queue->idleCond, &queue->lock);
         }
     }
 }
 
+// Busy queues pick up at RING_HEAD
+static void pcie_test_device_dma_resume(PcieTestDevice *d)
+{
+    qatomic_set(&d->dmaPaused, false);
+    for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+        QEMU_LOCK_GUARD(&d->queues[q].lock);
+        qemu_cond_signal(&d->queues[q].cond);
+    }
+}
+
+// Keep the DMA engine quiesced while the VM is stopped, so neither guest memory nor the device state change under
+// a migration or snapshot
+static void pcie_test_device_vm_state_change(void *opaque, bool running, RunState state)
+{
+    PcieTestDevice *d = opaque;
+
+    if (running) {
+        pcie_test_device_dma_resume(d);
+    } else {
+        pcie_test_device_dma_pause(d);
+    }
+}
+
+static int pcie_test_device_pre_save(void *opaque)
+{
+    PcieTestDevice *d = opaque;
+
+    for (uint32_t counter = 0; counter < TEST_DEVICE_NUM_COUNTERS; counter++) {
+        d->counterState[counter] = stat64_get(&d->counters[counter]);
+    }
+    return 0;
+}
+
+static int pcie_test_device_post_load(void *opaque, int version_id)
+{
+    PcieTestDevice *d = opaque;
+
+    // The ring registers index the BAR0 descriptor slots and the completion queue, a ring in BAR0 always has
+    // QUEUE_NUM_DESC entries
+    for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+        PcieTestDeviceQueue *queue = &d->queues[q];
+        const uint32_t ringSize = MAX(pcie_test_device_ring_size(queue), 1);
+        const uint32_t cqSize = MAX(pcie_test_device_cq_size(queue), 1);
+        if (RING_REG(d->regs, q, PCIE_TEST_DEVICE_RING_HEAD) >= ringSize
+            || RING_REG(d->regs, q, PCIE_TEST_DEVICE_RING_TAIL) >= ringSize
+            || RING_REG(d->regs, q, PCIE_TEST_DEVICE_RING_CQ_HEAD) >= cqSize || queue->cqTail >= cqSize) {
+            return -EINVAL;
+        }
+    }
+    for (uint32_t counter = 0; counter < TEST_DEVICE_NUM_COUNTERS; counter++) {
+        stat64_init(&d->counters[counter], d->counterState[counter]);
+    }
+
+    // Busy queues resume once the VM runs, interrupts the source had not raised yet are raised now
+    if (qatomic_read(&d->pendingIrq) != 0) {
+        qemu_bh_schedule(d->completionBh);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_pcie_test_device_queue = {
+    .name = TYPE_PCIE_TEST_DEVICE "/queue",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields =
+        (const VMStateField[]){
+            VMSTATE_BOOL(busy, PcieTestDeviceQueue),
+            VMSTATE_UINT32(cqTail, PcieTestDeviceQueue),
+            VMSTATE_BOOL(cqPhase, PcieTestDeviceQueue),
+            VMSTATE_UINT32(coalPending, PcieTestDeviceQueue),
+            VMSTATE_TIMER_PTR(coalTimer, PcieTestDeviceQueue),
+            VMSTATE_END_OF_LIST(),
+        },
+};
+
+// BAR1 RAM, either our own or the memdev backend, migrates as a RAM block of its own
+static const VMStateDescription vmstate_pcie_test_device = {
+    .name = TYPE_PCIE_TEST_DEVICE,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = pcie_test_device_pre_save,
+    .post_load = pcie_test_device_post_load,
+    .fields =
+        (const VMStateField[]){
+            VMSTATE_PCI_DEVICE(parentPci, PcieTestDevice),
+            VMSTATE_MSIX(parentPci, PcieTestDevice),
+            VMSTATE_UINT32_ARRAY(regs, PcieTestDevice, PCIE_TEST_DEVICE_MIMO_MAX_SIZE_DWORDS),
+            VMSTATE_STRUCT_ARRAY(queues, PcieTestDevice, PCIE_TEST_DEVICE_NUM_QUEUES, 1,
+                                 vmstate_pcie_test_device_queue, PcieTestDeviceQueue),
+            VMSTATE_UINT32(pendingIrq, PcieTestDevice),
+            VMSTATE_INT64(linkBusyUntil, PcieTestDevice),
+            VMSTATE_UINT64_ARRAY(counterState, PcieTestDevice, TEST_DEVICE_NUM_COUNTERS),
+            VMSTATE_UINT64_ARRAY(counterSnapshot, PcieTestDevice, TEST_DEVICE_NUM_COUNTERS),
+            VMSTATE_END_OF_LIST(),
+        },
+};
+
 static void pcie_test_device_init(Object *obj) { DEBUG_PRINT("%s - Initialize device object\n", __func__); }
 
 static void pcie_test_device_realize(PCIDevice *pci_dev, Error **errp)
@@ -293,51 +1309,233 @@ static void pcie_test_device_realize(PCIDevice *pci_dev, Error **errp)
 
     DEBUG_PRINT("%s - Realizing device\n", __func__);
 
+    // Device memory comes from a host memory backend (e.g. hugepages) or is plain RAM of x-mem-size
+    if (d->memdev != NULL) {
+        if (host_memory_backend_is_mapped(d->memdev)) {
+            error_setg(errp, "memdev %s is already in use",
+                       object_get_canonical_path_component(OBJECT(d->memdev)));
+            return;
+        }
+        d->memRegion = host_memory_backend_get_memory(d->memdev);
+        d->memSize = memory_region_size(d->memRegion);
+    } else {
+        d->memRegion = &d->mem;
+    }
+    if (!pci_bus_is_express(pci_get_bus(pci_dev))) {
+        error_setg(errp, "%s must be plugged into a PCI Express bus", TYPE_PCIE_TEST_DEVICE);
+        return;
+    }
+    if (!is_power_of_2(d->memSize) || d->memSize < PCIE_TEST_DEVICE_BUFF_SIZE_BYTES
+        || d->memSize > PCIE_TEST_DEVICE_MEM_MAX_SIZE_BYTES) {
+        error_setg(errp, "device memory size 0x%" PRIx64 " must be a power of two in [0x%x, 0x%" PRIx64 "]",
+                   d->memSize, PCIE_TEST_DEVICE_BUFF_SIZE_BYTES, (uint64_t)PCIE_TEST_DEVICE_MEM_MAX_SIZE_BYTES);
+        return;
+    }
+    // Backend RAM only migrates once its user registers it, memory_region_init_ram() does that for BAR1 RAM
+    if (d->memdev != NULL) {
+        host_memory_backend_set_mapped(d->memdev, true);
+        vmstate_register_ram(d->memRegion, DEVICE(d));
+    } else if (!memory_region_init_ram(&d->mem, OBJECT(d), "pcie-test-deve-bar1", d->memSize, errp)) {
+        return;
+    }
+
     // Setup BARs from 0 - PCI_NUM_REGIONS-1
     // Register callbacks to BAR0 mmio region
-    memory_region_init_io(&d->bar0, OBJECT(d), &bar_ops, d, "pcie-test-device-bar0",
-                          PCIE_TEST_DEVICE_MIMO_MAX_SIZE_BYTES);
+    memory_region_init_io(&d->bar0, OBJECT(d), &bar_ops, d, "pcie-test-device-bar0", PCIE_TEST_DEVICE_BAR0_SIZE_BYTES);
     pci_register_bar(pci_dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &d->bar0);
 
-    // Initialize device memory region
-    memory_region_init_ram(&d->mem, OBJECT(d), "pcie-test-deve-bar1", PCIE_TEST_DEVICE_BUFF_SIZE_BYTES, errp);
-    pci_register_bar(pci_dev, 1, PCI_BASE_ADDRESS_SPACE_MEMORY, &d->mem);
+    // Device memory, 64-bit prefetchable so large sizes can be placed above 4 GiB. Takes BAR1 and BAR2.
+    pci_register_bar(pci_dev, 1,
+                     PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 | PCI_BASE_ADDRESS_MEM_PREFETCH,
+                     d->memRegion);
 
     // Reset registers and write a test pattern
     pcie_test_device_reset_regs_and_mem(&(pci_dev->qdev), true);
 
+    // Track BAR1 writes, a reset only scrubs the pages written since
+    memory_region_set_log(d->memRegion, true, DIRTY_MEMORY_VGA);
+    memory_region_reset_dirty(d->memRegion, 0, d->memSize, DIRTY_MEMORY_VGA);
+
+    if (d->ioeventfd) {
+        for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+            const int ret = event_notifier_init(&d->queues[q].kick, 0);
+            if (ret < 0) {
+                while (q-- > 0) {
+                    event_notifier_cleanup(&d->queues[q].kick);
+                }
+                error_setg_errno(errp, -ret, "failed to create doorbell eventfd");
+                goto fail_mem;
+            }
+        }
+    }
+
     // Set up interrupt for IntA
     pci_config_set_interrupt_pin(pci_dev->config, PCIE_TEST_DEVICE_INTERRUPT_PIN);
 
     // MSI-X state is managed internally in PCIDevice
     if (msix_init_exclusive_bar(pci_dev, PCIE_TEST_DEVICE_MSIX_VECTORS, PCIE_TEST_DEVICE_MSIX_BAR, errp)) {
         DEBUG_PRINT("%s - Failed to initialize MSI-X\n", __func__);
-        assert(false);
+        goto fail_eventfd;
     }
     for (uint32_t i = 0; i < PCIE_TEST_DEVICE_MSIX_VECTORS; i++) {
         msix_vector_use(pci_dev, i);
     }
 
-    if (!pci_bus_is_express(pci_get_bus(pci_dev))) {
-        assert(false);
-    }
-
     // Will end up as a RC integrated EP
     // https://gitlab.com/qemu-project/qemu/-/blob/v10.0.0/hw/pci/pcie.c?ref_type=tags#L290
-    pcie_endpoint_cap_init(pci_dev, 0);
+    const int capOffset = pcie_endpoint_cap_init(pci_dev, 0);
+    if (capOffset < 0) {
+        error_setg_errno(errp, -capOffset, "failed to add the PCI Express capability");
+        goto fail_msix;
+    }
     // pcie_cap_init(pci_dev, 0, PCI_EXP_TYPE_ENDPOINT, 0, errp);
-    // pcie_cap_fill_link_ep_usp(pci_dev, d->width, d->speed);
+
+    // Only an endpoint below a port has a link to advertise
+    if (!pci_bus_is_root(pci_get_bus(pci_dev))) {
+        pcie_cap_fill_link_ep_usp(pci_dev, d->width, d->speed);
+    }
+
+    // Start the DMA engine, nothing fails past this point
+    d->dmaStopping = false;
+    d->dmaPaused = false;
+    d->completionBh = qemu_bh_new_guarded(pcie_test_device_completion_bh, d, &DEVICE(d)->mem_reentrancy_guard);
+    qemu_mutex_init(&d->linkLock);
+    qemu_cond_init(&d->linkCond);
+    d->linkTimer = timer_new_ns(QEMU_CLOCK_VIRTUAL, pcie_test_device_link_timer, d);
+    d->linkBusyUntil = 0;
+    for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+        PcieTestDeviceQueue *queue = &d->queues[q];
+        char name[32];
+
+        queue->dev = d;
+        queue->id = q;
+        queue->busy = false;
+        queue->active = false;
+        queue->cqTail = 0;
+        queue->cqPhase = true;
+        queue->coalPending = 0;
+        queue->coalTimer = timer_new_ns(QEMU_CLOCK_VIRTUAL, pcie_test_device_coal_timer, queue);
+        qemu_mutex_init(&queue->lock);
+        qemu_cond_init(&queue->cond);
+        qemu_cond_init(&queue->idleCond);
+        snprintf(name, sizeof(name), "pcie-test-dma%" PRIu32, q);
+        qemu_thread_create(&queue->thread, name, pcie_test_device_dma_thread, queue, QEMU_THREAD_JOINABLE);
+    }
+
+    d->vmStateEntry = qemu_add_vm_change_state_handler(pcie_test_device_vm_state_change, d);
+
+    // Kicks skip the MMIO dispatch, under KVM they do not even exit to userspace
+    if (d->ioeventfd) {
+        AioContext *ctx = pcie_test_device_kick_context(d);
+        for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+            PcieTestDeviceQueue *queue = &d->queues[q];
+            aio_set_event_notifier(ctx, &queue->kick, pcie_test_device_kick_notify, NULL, NULL);
+            memory_region_add_eventfd(&d->bar0, PCIE_TEST_DEVICE_DOORBELL_OFFSET(q) + PCIE_TEST_DEVICE_RING_KICK,
+                                      sizeof(uint32_t), false, 0, &queue->kick);
+        }
+    }
+    return;
+
+    // Undo the completed steps in reverse order
+fail_msix:
+    msix_uninit_exclusive_bar(pci_dev);
+fail_eventfd:
+    if (d->ioeventfd) {
+        for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+            event_notifier_cleanup(&d->queues[q].kick);
+        }
+    }
+fail_mem:
+    memory_region_set_log(d->memRegion, false, DIRTY_MEMORY_VGA);
+    if (d->memdev != NULL) {
+        vmstate_unregister_ram(d->memRegion, DEVICE(d));
+        host_memory_backend_set_mapped(d->memdev, false);
+    }
 }
 
-static void pcie_test_device_reset(DeviceState *qdev) { DEBUG_PRINT("%s - Reset device\n", __func__); }
+// Back to the state after realize. Only the BAR1 pages written since the last scrub are scrubbed again.
+static void pcie_test_device_reset(DeviceState *qdev)
+{
+    PcieTestDevice *d = PCIE_TEST_DEVICE(qdev);
+
+    DEBUG_PRINT("%s - Reset device\n", __func__);
+
+    pcie_test_device_dma_pause(d);
+    for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+        PcieTestDeviceQueue *queue = &d->queues[q];
+
+        QEMU_LOCK_GUARD(&queue->lock);
+        qatomic_set(&queue->busy, false);
+        queue->cqTail = 0;
+        queue->cqPhase = true;
+        queue->coalPending = 0;
+        timer_del(queue->coalTimer);
+    }
+    qemu_mutex_lock(&d->linkLock);
+    d->linkBusyUntil = 0;
+    timer_del(d->linkTimer);
+    qemu_mutex_unlock(&d->linkLock);
+    qatomic_set(&d->pendingIrq, 0);
+
+    pcie_test_device_reset_regs_and_mem(qdev, false);
+    pcie_test_device_rescrub(d);
+
+    // A stopped VM resumes the engine once it runs
+    if (runstate_is_running()) {
+        pcie_test_device_dma_resume(d);
+    }
+}
 
 static void pcie_test_device_finalize(Object *object) { DEBUG_PRINT("%s - Finalize device\n", __func__); }
 
 static void pcie_test_device_exit(PCIDevice *pci_dev)
 {
+    PcieTestDevice *d = PCIE_TEST_DEVICE(pci_dev);
+
     DEBUG_PRINT("%s - Exit cleanup\n", __func__);
+
+    if (d->ioeventfd) {
+        AioContext *ctx = pcie_test_device_kick_context(d);
+        for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+            PcieTestDeviceQueue *queue = &d->queues[q];
+            memory_region_del_eventfd(&d->bar0, PCIE_TEST_DEVICE_DOORBELL_OFFSET(q) + PCIE_TEST_DEVICE_RING_KICK,
+                                      sizeof(uint32_t), false, 0, &queue->kick);
+            aio_set_event_notifier(ctx, &queue->kick, NULL, NULL, NULL);
+            event_notifier_cleanup(&queue->kick);
+        }
+    }
+
+    qemu_del_vm_change_state_handler(d->vmStateEntry);
+
+    // Stop the DMA engine, in-flight descriptors are finished first
+    qatomic_set(&d->dmaStopping, true);
+    qemu_mutex_lock(&d->linkLock);
+    qemu_cond_broadcast(&d->linkCond);
+    qemu_mutex_unlock(&d->linkLock);
+    for (uint32_t q = 0; q < PCIE_TEST_DEVICE_NUM_QUEUES; q++) {
+        PcieTestDeviceQueue *queue = &d->queues[q];
+
+        qemu_mutex_lock(&queue->lock);
+        qemu_cond_signal(&queue->cond);
+        qemu_mutex_unlock(&queue->lock);
+        qemu_thread_join(&queue->thread);
+        timer_free(queue->coalTimer);
+        qemu_cond_destroy(&queue->idleCond);
+        qemu_cond_destroy(&queue->cond);
+        qemu_mutex_destroy(&queue->lock);
+    }
+    qemu_bh_delete(d->completionBh);
+    timer_free(d->linkTimer);
+    qemu_cond_destroy(&d->linkCond);
+    qemu_mutex_destroy(&d->linkLock);
+
+    memory_region_set_log(d->memRegion, false, DIRTY_MEMORY_VGA);
     pcie_cap_exit(pci_dev);
     msix_uninit_exclusive_bar(pci_dev);
+    if (d->memdev != NULL) {
+        vmstate_unregister_ram(d->memRegion, DEVICE(d));
+        host_memory_backend_set_mapped(d->memdev, false);
+    }
 }
 
 static void pcie_test_device_class_init(ObjectClass *klass, void *data)
@@ -354,7 +1552,8 @@ static void pcie_test_device_class_init(ObjectClass *klass, void *data)
     // Device reset
     device_class_set_legacy_reset(dc, pcie_test_device_reset);
 
-    // Skip defining state serialisation
+    // Migration and snapshots
+    dc->vmsd = &vmstate_pcie_test_device;
 
     // Setup common PCI config space
     pcic->vendor_id = PCIE_TEST_DEVICE_VID;
@@ -0,0 +1,329 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "pcie_device_regs.h"
+#include "pcietest.h"
+
+#define CHAR_DEVICE_PATH "/dev/%s"
+
+#define MAX_SWEEP   16
+#define MAX_DEPTH   256
+#define MAX_THREADS 64
+
+// One swept parameter, given on the command line as a comma separated list
+typedef struct {
+    uint32_t values[MAX_SWEEP];
+    uint32_t count;
+} sweep_t;
+
+typedef struct {
+    pthread_t thread;
+    const char *path;
+    uint64_t span; // Bytes usable on both the host and the device side
+    uint32_t size;
+    uint32_t op_code;
+    uint32_t depth;
+    uint32_t ops;
+    bool direct;         // Drive a claimed queue from userspace instead of going through the driver
+    uint64_t *latencies; // Completion latency of every transfer in ns
+    int err;
+} bench_thread_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int parse_sweep(const char *arg, sweep_t *sweep, const uint32_t min_value)
+{
+    char *end;
+
+    sweep->count = 0;
+    do {
+        if (sweep->count == MAX_SWEEP) {
+            return -1;
+        }
+        const unsigned long value = strtoul(arg, &end, 0);
+        if (end == arg || value < min_value || value > UINT32_MAX) {
+            return -1;
+        }
+        sweep->values[sweep->count++] = value;
+        arg = end + 1;
+    } while (*end == ',');
+
+    return (*end == '\0') ? 0 : -1;
+}
+
+static int compare_u64(const void *lhs, const void *rhs)
+{
+    const uint64_t a = *(const uint64_t *)lhs;
+    const uint64_t b = *(const uint64_t *)rhs;
+    return (a > b) - (a < b);
+}
+
+static int bench_submit(bench_thread_t *t, pcietest_t *dev, const dma_ctrl_t *ctrl, uint64_t token)
+{
+    return t->direct ? pcietest_queue_submit(dev, ctrl, 1, token) : pcietest_submit(dev, ctrl, 1, token);
+}
+
+// Reap at least one completion, a claimed queue has no interrupt and is spun on
+static int bench_reap(bench_thread_t *t, pcietest_t *dev, pcietest_cpl_t *cpls)
+{
+    if (!t->direct) {
+        return pcietest_reap(dev, cpls, 1, t->depth);
+    }
+
+    int num;
+    do {
+        num = pcietest_queue_reap(dev, cpls, t->depth);
+    } while (num == 0);
+    return num;
+}
+
+// Keep `depth` transfers in flight, every submission is one transfer
+static void *bench_run(void *arg)
+{
+    bench_thread_t *t = arg;
+    pcietest_cpl_t cpls[MAX_DEPTH];
+    uint64_t start[MAX_DEPTH];
+
+    // Transfers rotate through the buffer, overlapping other threads does not matter for timing
+    const uint32_t slots = t->span / t->size;
+    uint32_t submitted = 0, done = 0;
+
+    pcietest_t *dev = pcietest_open(t->path, t->direct ? 0 : t->depth);
+    if (dev == NULL) {
+        t->err = 1;
+        return NULL;
+    }
+    // Every thread needs a queue of its own, the driver keeps one for itself
+    if (t->direct && pcietest_queue_claim(dev) != 0) {
+        t->err = 2;
+        pcietest_close(dev);
+        return NULL;
+    }
+
+    uint64_t now = now_ns();
+    for (uint32_t slot = 0; slot < t->depth && submitted < t->ops && t->err == 0; slot++) {
+        const uint64_t offset = (uint64_t)(submitted % slots) * t->size;
+        const dma_ctrl_t ctrl = { .op_code = t->op_code, .bytes = t->size, .src = offset, .dst = offset };
+        start[slot] = now;
+        if (bench_submit(t, dev, &ctrl, slot) != 0) {
+            // The ring is shared with the other threads on the same queue, lower the depth
+            t->err = 3;
+        }
+        submitted++;
+    }
+
+    while (t->err == 0 && done < t->ops) {
+        const int num = bench_reap(t, dev, cpls);
+        if (num <= 0) {
+            t->err = 4;
+            break;
+        }
+
+        // Completed slots are refilled right away
+        now = now_ns();
+        for (int idx = 0; idx < num; idx++) {
+            const uint32_t slot = cpls[idx].token;
+            if (cpls[idx].result != 0) {
+                t->err = 5;
+            }
+            t->latencies[done++] = now - start[slot];
+
+            if (submitted < t->ops && t->err == 0) {
+                const uint64_t offset = (uint64_t)(submitted % slots) * t->size;
+                const dma_ctrl_t ctrl = { .op_code = t->op_code, .bytes = t->size, .src = offset, .dst = offset };
+                start[slot] = now;
+                if (bench_submit(t, dev, &ctrl, slot) != 0) {
+                    t->err = 3;
+                }
+                submitted++;
+            }
+        }
+    }
+
+    // Waits for what is still in flight
+    pcietest_close(dev);
+    return NULL;
+}
+
+static int bench_one(const char *path, uint64_t span, uint32_t size, uint32_t op_code, uint32_t depth,
+                     uint32_t threads, uint32_t ops, bool direct)
+{
+    bench_thread_t workers[MAX_THREADS] = { 0 };
+    const uint32_t total = threads * ops;
+
+    uint64_t *latencies = malloc(total * sizeof(uint64_t));
+    if (latencies == NULL) {
+        fprintf(stderr, "ERROR: Out of memory!\n");
+        return 1;
+    }
+
+    for (uint32_t idx = 0; idx < threads; idx++) {
+        workers[idx] = (bench_thread_t){ .path = path,
+                                         .span = span,
+                                         .size = size,
+                                         .op_code = op_code,
+                                         .depth = depth,
+                                         .ops = ops,
+                                         .direct = direct,
+                                         .latencies = &latencies[idx * ops] };
+    }
+
+    const uint64_t begin = now_ns();
+    for (uint32_t idx = 0; idx < threads; idx++) {
+        pthread_create(&workers[idx].thread, NULL, bench_run, &workers[idx]);
+    }
+
+    int err = 0;
+    for (uint32_t idx = 0; idx < threads; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        if (workers[idx].err != 0) {
+            err = workers[idx].err;
+        }
+    }
+    const uint64_t elapsed = now_ns() - begin;
+
+    if (err != 0) {
+        fprintf(stderr, "ERROR: Run with %" PRIu32 " bytes, op %" PRIu32 ", depth %" PRIu32 ", %" PRIu32
+                        " threads failed (%d)!\n",
+                size, op_code, depth, threads, err);
+        free(latencies);
+        return 1;
+    }
+
+    qsort(latencies, total, sizeof(uint64_t), compare_u64);
+    const double seconds = elapsed / 1e9;
+    printf("%8" PRIu32 " %3" PRIu32 " %6" PRIu32 " %8" PRIu32 " %10.1f %10.0f %9.1f %9.1f %9.1f\n", size, op_code,
+           depth, threads, (double)total * size / seconds / 1e6, total / seconds, latencies[total * 50 / 100] / 1e3,
+           latencies[(uint64_t)total * 99 / 100] / 1e3, latencies[(uint64_t)total * 999 / 1000] / 1e3);
+
+    free(latencies);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-s sizes] [-d op_codes] [-q depths] [-t threads] [-n transfers] [-u] <device>\n"
+            "  -s  Transfer sizes in bytes (default 64,512,4096,32768)\n"
+            "  -d  Op codes, 0: host -> device, 1: device -> host, 2/3: same with CRC32C, needs -u (default 0,1)\n"
+            "  -q  Transfers in flight per thread (default 1,8,32)\n"
+            "  -t  Threads, each with its own file (default 1,2,4)\n"
+            "  -n  Transfers per thread and run (default 10000)\n"
+            "  -u  Submit and reap from userspace on a claimed queue per thread, needs CAP_SYS_RAWIO\n"
+            "Lists are comma separated, every combination is run.\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    sweep_t sizes = { .values = { 64, 512, 4096, 32768 }, .count = 4 };
+    sweep_t op_codes = { .values = { 0, 1 }, .count = 2 };
+    sweep_t depths = { .values = { 1, 8, 32 }, .count = 3 };
+    sweep_t threads = { .values = { 1, 2, 4 }, .count = 3 };
+    uint32_t ops = 10000;
+    bool direct = false;
+    char charDevice[512];
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:q:t:n:u")) != -1) {
+        int err = 0;
+        switch (opt) {
+        case 's':
+            err = parse_sweep(optarg, &sizes, 1);
+            break;
+        case 'd':
+            err = parse_sweep(optarg, &op_codes, 0);
+            break;
+        case 'q':
+            err = parse_sweep(optarg, &depths, 1);
+            break;
+        case 't':
+            err = parse_sweep(optarg, &threads, 1);
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 0);
+            err = (ops == 0) ? -1 : 0;
+            break;
+        case 'u':
+            direct = true;
+            break;
+        default:
+            err = -1;
+            break;
+        }
+        if (err != 0) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    snprintf(charDevice, sizeof(charDevice), CHAR_DEVICE_PATH, argv[optind]);
+    pcietest_t *dev = pcietest_open(charDevice, 0);
+    if (dev == NULL) {
+        fprintf(stderr, "Failed to open %s\n", charDevice);
+        return 1;
+    }
+    // Transfers use the same offset on both sides
+    const uint64_t buf_size = pcietest_buffer_size(dev);
+    const uint64_t span = (buf_size < pcietest_device_size(dev)) ? buf_size : pcietest_device_size(dev);
+    pcietest_close(dev);
+
+    for (uint32_t idx = 0; idx < sizes.count; idx++) {
+        if (sizes.values[idx] > span) {
+            fprintf(stderr, "ERROR: Transfer size %" PRIu32 " exceeds the DMA buffer or device memory!\n",
+                    sizes.values[idx]);
+            return 1;
+        }
+    }
+    for (uint32_t idx = 0; idx < op_codes.count; idx++) {
+        if (op_codes.values[idx] > (direct ? TEST_DEVICE_DMA_WRITE_CRC32C : TEST_DEVICE_DMA_WRITE)) {
+            fprintf(stderr, "ERROR: Invalid op code %" PRIu32 "!\n", op_codes.values[idx]);
+            return 1;
+        }
+    }
+    for (uint32_t idx = 0; idx < depths.count; idx++) {
+        if (depths.values[idx] > MAX_DEPTH) {
+            fprintf(stderr, "ERROR: Depth %" PRIu32 " exceeds %u!\n", depths.values[idx], MAX_DEPTH);
+            return 1;
+        }
+    }
+    for (uint32_t idx = 0; idx < threads.count; idx++) {
+        if (threads.values[idx] > MAX_THREADS) {
+            fprintf(stderr, "ERROR: Thread count %" PRIu32 " exceeds %u!\n", threads.values[idx], MAX_THREADS);
+            return 1;
+        }
+    }
+
+    printf("%8s %3s %6s %8s %10s %10s %9s %9s %9s\n", "bytes", "op", "depth", "threads", "MB/s", "IOPS", "p50 us",
+           "p99 us", "p999 us");
+
+    int result = 0;
+    for (uint32_t s = 0; s < sizes.count; s++) {
+        for (uint32_t d = 0; d < op_codes.count; d++) {
+            for (uint32_t q = 0; q < depths.count; q++) {
+                for (uint32_t t = 0; t < threads.count; t++) {
+                    result |= bench_one(charDevice, span, sizes.values[s], op_codes.values[d], depths.values[q],
+                                        threads.values[t], ops, direct);
+                }
+            }
+        }
+    }
+    return result;
+}
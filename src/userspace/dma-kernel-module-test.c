@@ -1,24 +1,35 @@
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <assert.h>
 
-#include <fcntl.h>
-#include <poll.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/mman.h>
 #include <unistd.h>
 
-#include "pcie-test-module.h"
+#include "pcie_device_regs.h"
+#include "pcietest.h"
 
-#define CHAR_DEVICE_PATH "/dev/%s"
+static const uint32_t EXPECTED_VERSION = 0x0200;
+static const uint32_t POLL_BUDGET_USEC = 1000;
+static const uint64_t FILL_PATTERN = 0x0123456789ABCDEFull;
 
-static const uint32_t EXPECTED_VERSION = 0x0101;
-static const uint32_t BUFFER_SIZE_BYTES = 0x10000;
+#define ASYNC_NUM_TRANSFERS  16
+#define DIRECT_NUM_TRANSFERS 8
 
-static uint32_t poll_interrupt(int fd);
-static int test_dma_transfer(int fd, const dma_ctrl_t *dma_ctrl, uint32_t *irq_count);
+// With -p transfers are waited for in the driver by busy-polling instead of through poll() and read()
+static uint32_t poll_usec = 0;
+
+static uint32_t poll_interrupt(pcietest_t *dev);
+static int test_dma_transfer(pcietest_t *dev, const dma_ctrl_t *dma_ctrl, uint32_t *irq_count);
+static int test_dma_batch(pcietest_t *dev, const dma_ctrl_t *dma_ctrls, uint32_t count, int32_t *status,
+                          uint32_t *irq_count);
+static int test_dma_user(pcietest_t *dev, const dma_user_ctrl_t *dma_user_ctrl, uint32_t *irq_count);
+static int test_dma_async(pcietest_t *dev, const dma_ctrl_t *dma_ctrls, uint32_t count);
+static void test_dma_direct(const char *name);
+static uint32_t crc32c(const uint8_t *data, uint32_t len);
 
 int main(int argc, char *argv[])
 {
@@ -27,22 +38,32 @@ int main(int argc, char *argv[])
     uint32_t version, int_status, int_mask, value;
     dma_ctrl_t dma_ctrl = { 0 };
 
-    char charDevice[512];
+    int opt;
+    while ((opt = getopt(argc, argv, "p")) != -1) {
+        switch (opt) {
+        case 'p':
+            poll_usec = POLL_BUDGET_USEC;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p] <device>\n", argv[0]);
+            return 1;
+        }
+    }
 
-    if (argc < 2) {
+    if (optind >= argc) {
         fprintf(stderr, "ERROR: Missing character device name!\n");
         return 1;
     }
 
-    snprintf(charDevice, sizeof(charDevice), CHAR_DEVICE_PATH, argv[1]);
-
     printf("Running Kernel module tests\n");
 
-    int fd = open(charDevice, O_RDWR);
-    if (fd == -1) {
-        fprintf(stderr, "Failed to open %s\n", charDevice);
+    // Opening the handle maps the DMA buffer
+    pcietest_t *dev = pcietest_open(argv[optind], ASYNC_NUM_TRANSFERS);
+    if (dev == NULL) {
+        fprintf(stderr, "Failed to open %s\n", argv[optind]);
         return 1;
     }
+    const int fd = pcietest_fd(dev);
 
     printf("--- Checking Version Register ---\n");
     if (ioctl(fd, PCIE_TEST_IOCTL_DEVICE_VERSION, &version) < 0) {
@@ -65,7 +86,8 @@ int main(int argc, char *argv[])
     // Interrupt Status should be 0 before the test
     assert(int_status == 0);
 
-    int_mask = 0x1;
+    // Enable the interrupt of every queue, transfers run on the queue of the submitting CPU
+    int_mask = 0xF;
     if (ioctl(fd, PCIE_TEST_IOCTL_SET_INT_MASK, &int_mask) < 0) {
         fprintf(stderr, "ERROR: Failed to write to interrupt mask register!\n");
         return 5;
@@ -78,7 +100,7 @@ int main(int argc, char *argv[])
         return 6;
     }
 
-    init_irq_count = poll_interrupt(fd);
+    init_irq_count = poll_interrupt(dev);
 
     if (ioctl(fd, PCIE_TEST_IOCTL_GET_INT_STATUS, &int_status) < 0) {
         fprintf(stderr, "ERROR: Failed to read the interrupt status!\n");
@@ -87,14 +109,8 @@ int main(int argc, char *argv[])
     assert(int_status == 0x0);
 
     printf("--- Testing Device Memory ---\n");
-    void *buf = mmap(NULL, BUFFER_SIZE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buf == MAP_FAILED) {
-        fprintf(stderr, "ERROR: Failed to mmap!\n");
-        close(fd);
-        return 1;
-    }
-
-    memset(buf, 0, BUFFER_SIZE_BYTES);
+    void *buf = pcietest_buffer(dev);
+    memset(buf, 0, pcietest_buffer_size(dev));
     printf("Writing 32 bytes (decrementing pattern) to DMA buffer @ 0x0 from userspace...\n");
     printf("Writing 32 bytes (incrementing pattern) to DMA buffer @ 0x120 from userspace...\n");
     for (uint32_t idx = 0; idx < 32; idx++) {
@@ -108,7 +124,7 @@ int main(int argc, char *argv[])
     dma_ctrl.bytes = 32;
     printf("Transfer contents from DMA buffer to device (%" PRIu32 " bytes @ 0x%" PRIx64 " to 0x%" PRIx64 ")\n",
            dma_ctrl.bytes, dma_ctrl.src, dma_ctrl.dst);
-    assert(test_dma_transfer(fd, &dma_ctrl, &init_irq_count) == 0);
+    assert(test_dma_transfer(dev, &dma_ctrl, &init_irq_count) == 0);
 
     dma_ctrl.op_code = 0;
     dma_ctrl.src = 0x120;
@@ -116,7 +132,7 @@ int main(int argc, char *argv[])
     dma_ctrl.bytes = 32;
     printf("Transfer contents from DMA buffer to device (%" PRIu32 " bytes @ 0x%" PRIx64 " to 0x%" PRIx64 ")\n",
            dma_ctrl.bytes, dma_ctrl.src, dma_ctrl.dst);
-    assert(test_dma_transfer(fd, &dma_ctrl, &init_irq_count) == 0);
+    assert(test_dma_transfer(dev, &dma_ctrl, &init_irq_count) == 0);
 
     dma_ctrl.op_code = 1;
     dma_ctrl.src = 0x0;
@@ -124,7 +140,7 @@ int main(int argc, char *argv[])
     dma_ctrl.bytes = 32;
     printf("Transfer contents from device to DMA buffer (%" PRIu32 " bytes @ 0x%" PRIx64 " to 0x%" PRIx64 ")\n",
            dma_ctrl.bytes, dma_ctrl.src, dma_ctrl.dst);
-    assert(test_dma_transfer(fd, &dma_ctrl, &init_irq_count) == 0);
+    assert(test_dma_transfer(dev, &dma_ctrl, &init_irq_count) == 0);
 
     dma_ctrl.op_code = 1;
     dma_ctrl.src = 0x120;
@@ -132,7 +148,7 @@ int main(int argc, char *argv[])
     dma_ctrl.bytes = 32;
     printf("Transfer contents from device to DMA buffer (%" PRIu32 " bytes @ 0x%" PRIx64 " to 0x%" PRIx64 ")\n",
            dma_ctrl.bytes, dma_ctrl.src, dma_ctrl.dst);
-    assert(test_dma_transfer(fd, &dma_ctrl, &init_irq_count) == 0);
+    assert(test_dma_transfer(dev, &dma_ctrl, &init_irq_count) == 0);
 
     dma_ctrl.op_code = 1;
     dma_ctrl.src = 0x0;
@@ -140,7 +156,24 @@ int main(int argc, char *argv[])
     dma_ctrl.bytes = 16;
     printf("Transfer contents device to DMA buffer (%" PRIu32 " bytes @ 0x%" PRIx64 " to 0x%" PRIx64 ")\n",
            dma_ctrl.bytes, dma_ctrl.src, dma_ctrl.dst);
-    assert(test_dma_transfer(fd, &dma_ctrl, &init_irq_count) == 0);
+    assert(test_dma_transfer(dev, &dma_ctrl, &init_irq_count) == 0);
+
+    printf("Writing 64 bytes (xor pattern) to DMA buffer @ 0x1000 from userspace...\n");
+    for (uint32_t idx = 0; idx < 64; idx++) {
+        *((uint8_t *)buf + 0x1000 + idx) = (0xA5 ^ idx);
+    }
+
+    // Descriptors in one batch are processed in order, so the second entry sees the data of the first.
+    // The last entry runs past the DMA buffer, it is rejected on its own without failing the others.
+    dma_ctrl_t batch_ctrl[3] = {
+        { .op_code = 0, .src = 0x1000, .dst = 0x1000, .bytes = 64 },
+        { .op_code = 1, .src = 0x1000, .dst = 0x2000, .bytes = 64 },
+        { .op_code = 0, .src = 0xfff0, .dst = 0x0, .bytes = 0x100 },
+    };
+    int32_t batch_status[3] = { 0 };
+    printf("Batched transfer DMA buffer -> device -> DMA buffer (64 bytes @ 0x1000 to 0x2000)\n");
+    assert(test_dma_batch(dev, batch_ctrl, 3, batch_status, &init_irq_count) == 0);
+    assert(batch_status[0] == 0 && batch_status[1] == 0 && batch_status[2] < 0);
 
     printf("Checking buffer content\n");
 
@@ -193,41 +226,336 @@ int main(int argc, char *argv[])
         }
     }
 
-    munmap(buf, BUFFER_SIZE_BYTES);
-    close(fd);
+    // Buffer @ 0x2000 should have the xor pattern
+    buf_offset = 0x2000;
+    num_check_bytes = 64;
+    for (uint32_t idx = 0; idx < num_check_bytes; idx++) {
+        volatile uint8_t *pRegAddr = ((uint8_t *)buf + buf_offset + idx);
+        if (*pRegAddr != (0xA5 ^ idx)) {
+            fprintf(stderr, "ERROR: Mismatch data @ 0x%" PRIx32 " - 0x%" PRIx8 " vs 0x%" PRIx8 "\n", buf_offset + idx,
+                    (0xA5 ^ idx), *pRegAddr);
+        }
+    }
+
+    printf("--- Testing User Buffer DMA ---\n");
+    // Unaligned and spanning several pages so the device walks a scatter-gather list
+    const uint32_t user_bytes = 3 * 4096 + 123;
+    uint8_t *user_src = malloc(user_bytes + 1);
+    uint8_t *user_dst = malloc(user_bytes + 1);
+    assert(user_src != NULL && user_dst != NULL);
+    for (uint32_t idx = 0; idx < user_bytes; idx++) {
+        user_src[idx + 1] = (uint8_t)(idx * 7);
+    }
+    memset(user_dst, 0, user_bytes + 1);
+
+    dma_user_ctrl_t user_ctrl = { .op_code = 0,
+                                  .user_addr = (uint64_t)(uintptr_t)(user_src + 1),
+                                  .bytes = user_bytes,
+                                  .dev_addr = 0x4000 };
+    printf("Transfer user buffer to device (%" PRIu32 " bytes to 0x4000)\n", user_bytes);
+    assert(test_dma_user(dev, &user_ctrl, &init_irq_count) == 0);
+
+    user_ctrl.op_code = 1;
+    user_ctrl.user_addr = (uint64_t)(uintptr_t)(user_dst + 1);
+    printf("Transfer device to user buffer (%" PRIu32 " bytes @ 0x4000)\n", user_bytes);
+    assert(test_dma_user(dev, &user_ctrl, &init_irq_count) == 0);
+
+    printf("Checking buffer content\n");
+    if (memcmp(user_src + 1, user_dst + 1, user_bytes) != 0) {
+        fprintf(stderr, "ERROR: Mismatch data in user buffer\n");
+    }
+    free(user_src);
+    free(user_dst);
+
+    printf("--- Testing Mapped Device Memory ---\n");
+    uint8_t *dev_mem = pcietest_device_mem(dev);
+    assert(dev_mem != NULL);
+    printf("Writing 256 bytes to device memory @ 0x6000 from userspace...\n");
+    for (uint32_t idx = 0; idx < 0x100; idx++) {
+        dev_mem[0x6000 + idx] = (uint8_t)(idx ^ 0x3C);
+    }
+    pcietest_device_flush();
+
+    memset((uint8_t *)buf + 0x6000, 0, 0x100);
+    dma_ctrl.op_code = 1;
+    dma_ctrl.src = 0x6000;
+    dma_ctrl.dst = 0x6000;
+    dma_ctrl.bytes = 0x100;
+    printf("Transfer contents from device to DMA buffer (%" PRIu32 " bytes @ 0x%" PRIx64 " to 0x%" PRIx64 ")\n",
+           dma_ctrl.bytes, dma_ctrl.src, dma_ctrl.dst);
+    assert(test_dma_transfer(dev, &dma_ctrl, &init_irq_count) == 0);
+
+    printf("Checking buffer content\n");
+    for (uint32_t idx = 0; idx < 0x100; idx++) {
+        if (*((uint8_t *)buf + 0x6000 + idx) != (uint8_t)(idx ^ 0x3C)) {
+            fprintf(stderr, "ERROR: Mismatch data in mapped device memory at offset 0x%x\n", 0x6000 + idx);
+            break;
+        }
+    }
+
+    printf("--- Testing Device Operations ---\n");
+    // Processed in order, the copy sees the fill and the transfer sees the copy
+    dma_ctrl_t local_ctrl[3] = {
+        { .op_code = TEST_DEVICE_DMA_FILL, .src = FILL_PATTERN, .dst = 0x7000, .bytes = 0x100 },
+        { .op_code = TEST_DEVICE_DMA_COPY, .src = 0x7000, .dst = 0x7100, .bytes = 0x100 },
+        { .op_code = 1, .src = 0x7100, .dst = 0x7000, .bytes = 0x100 },
+    };
+    memset((uint8_t *)buf + 0x7000, 0, 0x100);
+    printf("Fill device @ 0x7000, copy it to 0x7100 and transfer that to DMA buffer (256 bytes)\n");
+    assert(test_dma_batch(dev, local_ctrl, 3, NULL, &init_irq_count) == 0);
+
+    printf("Checking buffer content\n");
+    for (uint32_t idx = 0; idx < 0x100; idx++) {
+        if (*((uint8_t *)buf + 0x7000 + idx) != (uint8_t)(FILL_PATTERN >> ((idx % 8) * 8))) {
+            fprintf(stderr, "ERROR: Mismatch data in filled device memory at offset 0x%x\n", 0x7000 + idx);
+            break;
+        }
+    }
+
+    printf("--- Testing Direct Submission ---\n");
+    test_dma_direct(argv[optind]);
+
+    // Runs last, its completions raise interrupts nobody waits for
+    printf("--- Testing Async Submission ---\n");
+    dma_ctrl_t async_ctrl[ASYNC_NUM_TRANSFERS];
+    for (uint32_t idx = 0; idx < 0x100 * ASYNC_NUM_TRANSFERS; idx++) {
+        *((uint8_t *)buf + 0x8000 + idx) = (uint8_t)(idx * 3);
+    }
+    memset((uint8_t *)buf + 0xA000, 0, 0x100 * ASYNC_NUM_TRANSFERS);
+
+    for (uint32_t idx = 0; idx < ASYNC_NUM_TRANSFERS; idx++) {
+        async_ctrl[idx] = (dma_ctrl_t){ .op_code = 0, .src = 0x8000 + idx * 0x100, .dst = 0x8000 + idx * 0x100,
+                                        .bytes = 0x100 };
+    }
+    printf("%u transfers in flight DMA buffer -> device (256 bytes each @ 0x8000)\n", ASYNC_NUM_TRANSFERS);
+    assert(test_dma_async(dev, async_ctrl, ASYNC_NUM_TRANSFERS) == 0);
+
+    for (uint32_t idx = 0; idx < ASYNC_NUM_TRANSFERS; idx++) {
+        async_ctrl[idx] = (dma_ctrl_t){ .op_code = 1, .src = 0x8000 + idx * 0x100, .dst = 0xA000 + idx * 0x100,
+                                        .bytes = 0x100 };
+    }
+    printf("%u transfers in flight device -> DMA buffer (256 bytes each @ 0x8000 to 0xA000)\n",
+           ASYNC_NUM_TRANSFERS);
+    assert(test_dma_async(dev, async_ctrl, ASYNC_NUM_TRANSFERS) == 0);
+
+    printf("Checking buffer content\n");
+    if (memcmp((uint8_t *)buf + 0x8000, (uint8_t *)buf + 0xA000, 0x100 * ASYNC_NUM_TRANSFERS) != 0) {
+        fprintf(stderr, "ERROR: Mismatch data in async transfers\n");
+    }
+
+    pcietest_close(dev);
 
     printf("Kernel module tests passed \xE2\x9C\x93!\n");
 
     return 0;
 }
 
-static uint32_t poll_interrupt(int fd)
+static uint32_t poll_interrupt(pcietest_t *dev)
+{
+    uint32_t irq_count = 0;
+
+    if (pcietest_wait_interrupt(dev, &irq_count) != 0) {
+        printf("ERROR: Error occured during read\n");
+    }
+    return irq_count;
+}
+
+static int test_dma_transfer(pcietest_t *dev, const dma_ctrl_t *dma_ctrl, uint32_t *init_irq_count)
 {
-    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll_usec != 0) {
+        return test_dma_batch(dev, dma_ctrl, 1, NULL, init_irq_count);
+    }
+
+    if (ioctl(pcietest_fd(dev), PCIE_TEST_IOCTL_START_TRANSFER, dma_ctrl) < 0) {
+        fprintf(stderr, "ERROR: Failed to start DMA transfer!\n");
+        return 7;
+    }
 
-    poll(&pfd, 1, -1); // wait forever
-    if (pfd.revents & POLLIN) {
-        uint32_t irq_count = 0;
+    uint32_t irq_count = poll_interrupt(dev);
+    assert(irq_count == (*init_irq_count + 1));
+    *init_irq_count = irq_count;
 
-        ssize_t bytes = read(fd, &irq_count, sizeof(irq_count));
-        if (bytes != sizeof(irq_count)) {
-            printf("ERROR: Error occured during read\n");
+    return 0;
+}
+
+static int test_dma_batch(pcietest_t *dev, const dma_ctrl_t *dma_ctrls, uint32_t count, int32_t *status,
+                          uint32_t *init_irq_count)
+{
+    // The batch already completed, its interrupt is not waited for
+    if (poll_usec != 0) {
+        if (pcietest_batch(dev, dma_ctrls, count, status, poll_usec) != 0) {
+            fprintf(stderr, "ERROR: Failed to run DMA batch!\n");
+            return 7;
         }
-        return irq_count;
+        return 0;
     }
-    return 8;
+
+    dma_batch_t batch = { .count = count,
+                          .entries = (uint64_t)(uintptr_t)dma_ctrls,
+                          .status = (uint64_t)(uintptr_t)status };
+    if (ioctl(pcietest_fd(dev), PCIE_TEST_IOCTL_SUBMIT_BATCH, &batch) < 0) {
+        fprintf(stderr, "ERROR: Failed to submit DMA batch!\n");
+        return 7;
+    }
+
+    // A whole batch completes with a single interrupt
+    uint32_t irq_count = poll_interrupt(dev);
+    assert(irq_count == (*init_irq_count + 1));
+    *init_irq_count = irq_count;
+
+    return 0;
 }
 
-static int test_dma_transfer(int fd, const dma_ctrl_t *dma_ctrl, uint32_t *init_irq_count)
+static int test_dma_user(pcietest_t *dev, const dma_user_ctrl_t *dma_user_ctrl, uint32_t *init_irq_count)
 {
-    if (ioctl(fd, PCIE_TEST_IOCTL_START_TRANSFER, dma_ctrl) < 0) {
-        fprintf(stderr, "ERROR: Failed to start DMA transfer!\n");
+    // Returns once the transfer is done, the pages are pinned for its duration
+    if (pcietest_user_transfer(dev, dma_user_ctrl) != 0) {
+        fprintf(stderr, "ERROR: Failed to run user buffer DMA transfer!\n");
         return 7;
     }
+    if (poll_usec != 0) {
+        return 0;
+    }
 
-    uint32_t irq_count = poll_interrupt(fd);
+    uint32_t irq_count = poll_interrupt(dev);
     assert(irq_count == (*init_irq_count + 1));
     *init_irq_count = irq_count;
 
     return 0;
 }
+
+static int test_dma_async(pcietest_t *dev, const dma_ctrl_t *dma_ctrls, uint32_t count)
+{
+    pcietest_cpl_t cpls[ASYNC_NUM_TRANSFERS];
+    uint32_t seen = 0;
+
+    // Every submission is one transfer, the token is what its completion is matched by
+    assert(count <= ASYNC_NUM_TRANSFERS);
+    for (uint32_t idx = 0; idx < count; idx++) {
+        if (pcietest_submit(dev, &dma_ctrls[idx], 1, idx) != 0) {
+            fprintf(stderr, "ERROR: Failed to submit async DMA transfers!\n");
+            return 7;
+        }
+    }
+
+    assert(pcietest_reap(dev, cpls, count, count) == (int)count);
+    for (uint32_t idx = 0; idx < count; idx++) {
+        assert(cpls[idx].result == 0);
+        seen |= 1u << cpls[idx].token;
+    }
+    assert(seen == (1u << count) - 1);
+
+    return 0;
+}
+
+// Drives a claimed queue from userspace on a handle of its own, the queue goes back to the driver on close
+static void test_dma_direct(const char *name)
+{
+    dma_ctrl_t ctrls[DIRECT_NUM_TRANSFERS];
+    pcietest_cpl_t cpls[DIRECT_NUM_TRANSFERS];
+
+    pcietest_t *dev = pcietest_open(name, 0);
+    assert(dev != NULL);
+
+    const int err = pcietest_queue_claim(dev);
+    if (err == -EPERM || err == -EBUSY || err == -EOPNOTSUPP) {
+        printf("No queue to claim (%d), skipping\n", err);
+        pcietest_close(dev);
+        return;
+    }
+    assert(err == 0);
+
+    uint8_t *buf = pcietest_buffer(dev);
+    for (uint32_t idx = 0; idx < 0x80 * DIRECT_NUM_TRANSFERS; idx++) {
+        buf[0xC000 + idx] = (uint8_t)(idx * 5 + 1);
+    }
+    memset(buf + 0xD000, 0, 0x80 * DIRECT_NUM_TRANSFERS);
+
+    for (uint32_t dir = 0; dir < 2; dir++) {
+        for (uint32_t idx = 0; idx < DIRECT_NUM_TRANSFERS; idx++) {
+            ctrls[idx] = (dma_ctrl_t){ .op_code = dir,
+                                       .src = 0xC000 + idx * 0x80,
+                                       .dst = ((dir == 0) ? 0xC000 : 0xD000) + idx * 0x80,
+                                       .bytes = 0x80 };
+        }
+        printf("%u transfers %s through the claimed queue (128 bytes each)\n", DIRECT_NUM_TRANSFERS,
+               (dir == 0) ? "DMA buffer -> device" : "device -> DMA buffer");
+        assert(pcietest_queue_submit(dev, ctrls, DIRECT_NUM_TRANSFERS, dir) == 0);
+
+        // Nothing interrupts, spin on the completion queue
+        uint32_t done = 0;
+        while (done < DIRECT_NUM_TRANSFERS) {
+            const int num = pcietest_queue_reap(dev, &cpls[done], DIRECT_NUM_TRANSFERS - done);
+            assert(num >= 0);
+            done += num;
+        }
+        for (uint32_t idx = 0; idx < DIRECT_NUM_TRANSFERS; idx++) {
+            assert(cpls[idx].token == dir && cpls[idx].result == 0);
+        }
+    }
+
+    printf("Checking buffer content\n");
+    if (memcmp(buf + 0xC000, buf + 0xD000, 0x80 * DIRECT_NUM_TRANSFERS) != 0) {
+        fprintf(stderr, "ERROR: Mismatch data in direct transfers\n");
+    }
+
+    // Transfers of different length, the token tells the completions apart
+    printf("%u checksum transfers device -> DMA buffer through the claimed queue\n", DIRECT_NUM_TRANSFERS);
+    for (uint32_t idx = 0; idx < DIRECT_NUM_TRANSFERS; idx++) {
+        ctrls[idx] = (dma_ctrl_t){ .op_code = TEST_DEVICE_DMA_WRITE_CRC32C,
+                                   .src = 0xC000 + idx * 0x80,
+                                   .dst = 0xD000 + idx * 0x80,
+                                   .bytes = 0x80 - idx * 3 };
+        assert(pcietest_queue_submit(dev, &ctrls[idx], 1, idx) == 0);
+    }
+    uint32_t done = 0;
+    while (done < DIRECT_NUM_TRANSFERS) {
+        const int num = pcietest_queue_reap(dev, &cpls[done], DIRECT_NUM_TRANSFERS - done);
+        assert(num >= 0);
+        done += num;
+    }
+    for (uint32_t idx = 0; idx < DIRECT_NUM_TRANSFERS; idx++) {
+        const dma_ctrl_t *ctrl = &ctrls[cpls[idx].token];
+        assert(cpls[idx].result == 0);
+        if (cpls[idx].value != crc32c(buf + ctrl->dst, ctrl->bytes)) {
+            fprintf(stderr, "ERROR: CRC32C mismatch in transfer %" PRIu64 "\n", cpls[idx].token);
+        }
+    }
+
+    // Device memory @ 0x7100 holds the pattern of the device operations test, the second compare differs in byte 3
+    printf("Comparing device memory @ 0x7100 against a pattern through the claimed queue\n");
+    ctrls[0] = (dma_ctrl_t){ .op_code = TEST_DEVICE_DMA_COMPARE, .src = FILL_PATTERN, .dst = 0x7100, .bytes = 0x100 };
+    ctrls[1] = ctrls[0];
+    ctrls[1].src ^= 0xFFull << 24;
+    assert(pcietest_queue_submit(dev, &ctrls[0], 1, 0) == 0);
+    assert(pcietest_queue_submit(dev, &ctrls[1], 1, 1) == 0);
+    done = 0;
+    while (done < 2) {
+        const int num = pcietest_queue_reap(dev, &cpls[done], 2 - done);
+        assert(num >= 0);
+        done += num;
+    }
+    for (uint32_t idx = 0; idx < 2; idx++) {
+        const uint64_t expected = (cpls[idx].token == 0) ? 0x100 : 3;
+        assert(cpls[idx].result == 0);
+        if (cpls[idx].value != expected) {
+            fprintf(stderr, "ERROR: Compare %" PRIu64 " reported offset %" PRIu64 " instead of %" PRIu64 "\n",
+                    cpls[idx].token, cpls[idx].value, expected);
+        }
+    }
+    pcietest_close(dev);
+}
+
+// Bitwise reference for the device checksum
+static uint32_t crc32c(const uint8_t *data, uint32_t len)
+{
+    uint32_t crc = UINT32_MAX;
+
+    while (len-- > 0) {
+        crc ^= *data++;
+        for (uint32_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+    }
+    return crc ^ UINT32_MAX;
+}
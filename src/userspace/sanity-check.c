@@ -14,7 +14,7 @@ int main(int argc, char *argv[])
     int fd;
     char resourcePciePath[512];
 
-    const uint32_t EXPECTED_VERSION = 0x0101;
+    const uint32_t EXPECTED_VERSION = 0x0200;
 
     if (argc < 2) {
         fprintf(stderr, "ERROR: Missing PCI resource!\n");